@@ -0,0 +1,36 @@
+/*
+    License: MIT
+    Notes:
+        Minimal harness for the optional microbenchmarks.
+*/
+
+#pragma once
+#include "../Source/Stdinclude.hpp"
+
+namespace Benchmark
+{
+    // Benchmarks register themselves on startup, like the platforms.
+    void Addbenchmark(std::string Name, std::function<void()> Callback);
+
+    // Average nanoseconds per iteration of the callback.
+    template <typename Function> double Measure(size_t Iterations, Function &&Callback)
+    {
+        auto Start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < Iterations; ++i) Callback(i);
+        auto Elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count();
+        return Elapsed / double(Iterations ? Iterations : 1);
+    }
+
+    inline Address_t Makeaddress(const char *Plainaddress, uint16_t Port)
+    {
+        Address_t Result{};
+        Result.Port = Port;
+        std::strncpy(Result.Plainaddress, Plainaddress, sizeof(Result.Plainaddress) - 1);
+        return Result;
+    }
+
+    inline void Report(std::string_view Name, double Value, std::string_view Unit)
+    {
+        std::printf("%-48s %14.2f %s\n", Name.data(), Value, Unit.data());
+    }
+}
@@ -0,0 +1,119 @@
+/*
+    License: MIT
+    Notes:
+        Packetqueue_t push latency, throughput and ordering with 1, 4 and 16 producers.
+        Build with -DCMAKE_CXX_FLAGS=-fsanitize=thread to race-check the queue.
+*/
+
+#include "Benchmark.hpp"
+
+namespace
+{
+    // Every producer tags its packets with its index and a sequence number.
+    struct Tag_t
+    {
+        uint32_t Producer;
+        uint32_t Sequence;
+    };
+
+    // Nearest-rank percentile of the samples, which are sorted in place.
+    double Percentile(std::vector<uint32_t> &Samples, double Rank)
+    {
+        if (Samples.empty()) return 0;
+        auto Index = std::min(Samples.size() - 1, size_t(Rank * Samples.size()));
+        std::nth_element(Samples.begin(), Samples.begin() + Index, Samples.end());
+        return Samples[Index];
+    }
+
+    // Producers are timed on their own threads so the result shows contention on the push, not the drain.
+    void Packetqueue()
+    {
+        constexpr size_t Packetcount = 1000000;
+        const std::string Padding(64, 'x');
+
+        for (size_t Producercount : { 1, 4, 16 })
+        {
+            Packetqueue_t Queue;
+            std::atomic<size_t> Ready{ 0 };
+            std::vector<std::thread> Producers;
+            const size_t Perproducer = Packetcount / Producercount;
+            std::vector<std::vector<uint32_t>> Latencies(Producercount);
+            std::vector<std::chrono::steady_clock::time_point> Starttimes(Producercount), Endtimes(Producercount);
+
+            for (size_t i = 0; i < Producercount; ++i)
+            {
+                Producers.emplace_back([&, i]()
+                {
+                    auto &Samples = Latencies[i];
+                    Samples.reserve(Perproducer);
+
+                    Ready++;
+                    while (Ready != Producercount + 1) std::this_thread::yield();
+
+                    // One clock read per push, each sample is the time since the previous one.
+                    auto Previous = std::chrono::steady_clock::now();
+                    Starttimes[i] = Previous;
+                    for (size_t s = 0; s < Perproducer; ++s)
+                    {
+                        Tag_t Tag{ uint32_t(i), uint32_t(s) };
+                        auto Node = Queue.Allocate();
+                        Node->Data.assign(reinterpret_cast<const char *>(&Tag), sizeof(Tag));
+                        Node->Data.append(Padding);
+                        Queue.Push(Node);
+
+                        auto Now = std::chrono::steady_clock::now();
+                        Samples.push_back(uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Now - Previous).count()));
+                        Previous = Now;
+                    }
+                    Endtimes[i] = Previous;
+                });
+            }
+
+            // The single consumer drains concurrently and checks that no packet is lost, duplicated or reordered per producer.
+            std::vector<uint32_t> Expected(Producercount, 0);
+            size_t Received = 0, Errors = 0;
+            while (Ready != Producercount) std::this_thread::yield();
+            Ready++;
+
+            auto Start = std::chrono::steady_clock::now();
+            while (Received < Perproducer * Producercount)
+            {
+                auto Node = Queue.Pop();
+                if (!Node) { std::this_thread::yield(); continue; }
+
+                Tag_t Tag;
+                std::memcpy(&Tag, Node->Data.data(), sizeof(Tag));
+                if (Tag.Producer >= Producercount || Tag.Sequence != Expected[Tag.Producer]++) Errors++;
+
+                Queue.Recycle(Node);
+                Received++;
+            }
+            auto Drainseconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+            for (auto &Thread : Producers) Thread.join();
+
+            // From the first producer starting to the last one finishing.
+            auto First = *std::min_element(Starttimes.begin(), Starttimes.end());
+            auto Last = *std::max_element(Endtimes.begin(), Endtimes.end());
+            auto Pushseconds = std::chrono::duration<double>(Last - First).count();
+
+            std::vector<uint32_t> Samples;
+            Samples.reserve(Received);
+            for (auto &Item : Latencies) Samples.insert(Samples.end(), Item.begin(), Item.end());
+
+            Benchmark::Report(va("Packetqueue_t, %zu producers, push", Producercount), Received / Pushseconds, "packets/s");
+            Benchmark::Report(va("Packetqueue_t, %zu producers, push p50", Producercount), Percentile(Samples, 0.50), "ns");
+            Benchmark::Report(va("Packetqueue_t, %zu producers, push p99", Producercount), Percentile(Samples, 0.99), "ns");
+            Benchmark::Report(va("Packetqueue_t, %zu producers, drain", Producercount), Received / Drainseconds, "packets/s");
+            if (Errors || Queue.Pop()) Benchmark::Report(va("Packetqueue_t, %zu producers, errors", Producercount), double(Errors), "packets");
+        }
+    }
+
+    struct Installer
+    {
+        Installer()
+        {
+            Benchmark::Addbenchmark("Packetqueue", Packetqueue);
+        }
+    };
+    static Installer Startup{};
+}
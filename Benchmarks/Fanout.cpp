@@ -0,0 +1,98 @@
+/*
+    License: MIT
+    Notes:
+        Port-indexed filter lookups and fan-out of frames to the bound sockets.
+*/
+
+#include "Benchmark.hpp"
+
+namespace
+{
+    struct Fanoutserver : IDatagramserver {};
+    using Benchmark::Makeaddress;
+
+    void Drain(size_t First, size_t Last, std::vector<Localnetworking::Frame_t> &Frames)
+    {
+        for (size_t s = First; s <= Last; ++s)
+            while (Localnetworking::Dequeueframes(s * 4, Frames.data(), Frames.size())) {}
+    }
+
+    // Enqueueframe with hundreds of bound UDP sockets, one port each plus a few wildcards.
+    void Portlookup()
+    {
+        Fanoutserver Server;
+        std::vector<Localnetworking::Frame_t> Frames(64);
+        const std::string Packet(512, 'x');
+
+        for (size_t Count : { 10, 100, 500 })
+        {
+            for (size_t i = 1; i <= Count; ++i)
+            {
+                Localnetworking::Createsocket(&Server, i * 4);
+                Localnetworking::Addfilter(i * 4, Makeaddress("127.0.0.1", uint16_t(10000 + i)));
+            }
+            for (size_t i = 1; i <= 4; ++i)
+            {
+                Localnetworking::Createsocket(&Server, (Count + i) * 4);
+                Localnetworking::Addfilter((Count + i) * 4, Makeaddress("0.0.0.0", uint16_t(10000 + i)));
+            }
+
+            auto Routing = Benchmark::Measure(1000000, [&](size_t i)
+            {
+                auto Sockets = Localnetworking::Findinternalsockets(Makeaddress("127.0.0.1", uint16_t(10000 + (i % Count) + 1)));
+                (void)Sockets;
+            });
+
+            auto Enqueue = Benchmark::Measure(200000, [&](size_t i)
+            {
+                auto Socket = (i % Count) + 1;
+                Localnetworking::Enqueueframe(Makeaddress("127.0.0.1", uint16_t(10000 + Socket)), Packet);
+                if (0 == i % 32) Drain(1, Count + 4, Frames);
+            });
+
+            Benchmark::Report(va("Findinternalsockets, %zu bound", Count), Routing, "ns/op");
+            Benchmark::Report(va("Enqueueframe, %zu bound", Count), 1e9 / Enqueue, "packets/s");
+
+            for (size_t i = 1; i <= Count + 4; ++i) Localnetworking::Destroysocket(&Server, i * 4);
+        }
+    }
+
+    // One frame delivered to every socket bound to the same port, as with broadcast listeners.
+    void Sharedport()
+    {
+        Fanoutserver Server;
+        std::vector<Localnetworking::Frame_t> Frames(64);
+        const std::string Packet(512, 'x');
+
+        for (size_t Count : { 1, 10, 100, 500 })
+        {
+            for (size_t i = 1; i <= Count; ++i)
+            {
+                Localnetworking::Createsocket(&Server, i * 4);
+                Localnetworking::Addfilter(i * 4, Makeaddress(i % 2 ? "0.0.0.0" : "127.0.0.1", 27015));
+            }
+
+            // Drain before the queues hit their limit so every frame is delivered rather than dropped.
+            auto Enqueue = Benchmark::Measure(20000, [&](size_t i)
+            {
+                Localnetworking::Enqueueframe(Makeaddress("127.0.0.1", 27015), Packet);
+                if (0 == i % 512) Drain(1, Count, Frames);
+            });
+
+            Benchmark::Report(va("Enqueueframe, %zu sockets on one port", Count), Enqueue, "ns/frame");
+            Benchmark::Report(va("Enqueueframe, %zu sockets on one port", Count), 1e9 * Count / Enqueue, "deliveries/s");
+
+            for (size_t i = 1; i <= Count; ++i) Localnetworking::Destroysocket(&Server, i * 4);
+        }
+    }
+
+    struct Installer
+    {
+        Installer()
+        {
+            Benchmark::Addbenchmark("Portlookup", Portlookup);
+            Benchmark::Addbenchmark("Sharedport", Sharedport);
+        }
+    };
+    static Installer Startup{};
+}
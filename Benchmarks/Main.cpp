@@ -0,0 +1,33 @@
+/*
+    License: MIT
+    Notes:
+        Runs every registered benchmark, or those whose name contains argv[1].
+*/
+
+#include "Benchmark.hpp"
+
+namespace Benchmark
+{
+    std::vector<std::pair<std::string, std::function<void()>>> *Benchmarks;
+
+    void Addbenchmark(std::string Name, std::function<void()> Callback)
+    {
+        if (!Benchmarks) Benchmarks = new std::vector<std::pair<std::string, std::function<void()>>>();
+        Benchmarks->emplace_back(std::move(Name), std::move(Callback));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (!Benchmark::Benchmarks) return 0;
+
+    for (auto &Item : *Benchmark::Benchmarks)
+    {
+        if (argc > 1 && std::string::npos == Item.first.find(argv[1])) continue;
+
+        std::printf("== %s\n", Item.first.c_str());
+        Item.second();
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+    License: MIT
+    Notes:
+        Socket registry lookups.
+*/
+
+#include "Benchmark.hpp"
+
+namespace Localnetworking
+{
+    // Instancemanager is not linked, the pollthread is never started.
+    std::shared_ptr<const std::vector<IServer *>> Serverinstances()
+    {
+        return std::make_shared<const std::vector<IServer *>>();
+    }
+    void Maintainservers()
+    {
+    }
+}
+
+namespace
+{
+    struct Benchserver : IStreamserver
+    {
+        virtual void onData(const size_t Socket, std::vector<uint8_t> &Stream)
+        {
+            (void)Socket;
+            Stream.clear();
+        }
+    };
+
+    // Findserver(Socket) and isInternalsocket with 10 to 10.000 registered sockets.
+    void Socketlookup()
+    {
+        Benchserver Server;
+
+        for (size_t Count : { 10, 100, 1000, 10000 })
+        {
+            for (size_t i = 1; i <= Count; ++i) Localnetworking::Createsocket(&Server, i * 4);
+
+            volatile size_t Found = 0;
+            auto Lookup = Benchmark::Measure(1000000, [&](size_t i)
+            {
+                Found += nullptr != Localnetworking::Findserver(size_t((i % Count) + 1) * 4);
+            });
+            auto Internal = Benchmark::Measure(1000000, [&](size_t i)
+            {
+                Found += Localnetworking::isInternalsocket(size_t((i % Count) + 1) * 4);
+            });
+            auto Snapshot = Benchmark::Measure(100000, [&](size_t)
+            {
+                Found += Localnetworking::Internalsockets()->size();
+            });
+
+            Benchmark::Report(va("Findserver, %zu sockets", Count), Lookup, "ns/op");
+            Benchmark::Report(va("isInternalsocket, %zu sockets", Count), Internal, "ns/op");
+            Benchmark::Report(va("Internalsockets, %zu sockets", Count), Snapshot, "ns/op");
+
+            for (size_t i = 1; i <= Count; ++i) Localnetworking::Destroysocket(&Server, i * 4);
+        }
+    }
+
+    struct Installer
+    {
+        Installer()
+        {
+            Benchmark::Addbenchmark("Socketlookup", Socketlookup);
+        }
+    };
+    static Installer Startup{};
+}
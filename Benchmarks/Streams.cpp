@@ -0,0 +1,60 @@
+/*
+    License: MIT
+    Notes:
+        Throughput of the ring-buffered IStreamserver output.
+*/
+
+#include "Benchmark.hpp"
+
+namespace
+{
+    struct Streamserver : IStreamserver
+    {
+        virtual void onData(const size_t Socket, std::vector<uint8_t> &Stream)
+        {
+            (void)Socket;
+            Stream.clear();
+        }
+    };
+
+    // 100 MB through one IStreamserver connection, module to application.
+    void Streamthroughput()
+    {
+        constexpr size_t Total = 100 * 1024 * 1024;
+        constexpr uint32_t Chunk = 16 * 1024;
+        Streamserver Server;
+        Server.onConnect(4, 80);
+
+        auto Start = std::chrono::steady_clock::now();
+        std::thread Producer([&]()
+        {
+            const std::string Data(Chunk, 'x');
+            for (size_t Sent = 0; Sent < Total; Sent += Chunk)
+            {
+                while (!Server.isWritable(4)) std::this_thread::yield();
+                Server.Send(4, Data.data(), Chunk);
+            }
+        });
+
+        auto Buffer = std::make_unique<uint8_t[]>(64 * 1024);
+        for (size_t Received = 0; Received < Total;)
+        {
+            uint32_t Size = 64 * 1024;
+            if (Server.onStreamread(4, Buffer.get(), &Size)) Received += Size;
+            else Server.onStreamwait(4, 10);
+        }
+        Producer.join();
+
+        auto Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        Benchmark::Report("Stream loopback, 100 MB", Total / (1024.0 * 1024.0) / Seconds, "MB/s");
+    }
+
+    struct Installer
+    {
+        Installer()
+        {
+            Benchmark::Addbenchmark("Streamthroughput", Streamthroughput);
+        }
+    };
+    static Installer Startup{};
+}
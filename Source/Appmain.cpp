@@ -20,10 +20,19 @@ extern "C" EXPORT_ATTR void onInitializationStart(bool Reserved)
         ----------------------------------------------------------------------
     */
 
+    // A preloaded library may also get here from its first socket call, so only run once.
+    static std::atomic<bool> Initialized{ false };
+    if (Initialized.exchange(true)) return;
+
     // Initialize the modules and datagram IO.
     Localnetworking::Startpollthread();
     Localnetworking::Loadallmodules();
 
+    // Hot reloading is a development feature.
+    #if !defined(NDEBUG)
+    Localnetworking::Startmodulewatcher();
+    #endif
+
     // Initialize the platform hooks.
     Localnetworking::Initializeplatforms();
 }
@@ -67,8 +76,7 @@ extern "C" EXPORT_ATTR void onMessage(uint32_t MessageID, uint32_t Messagesize,
 
             // Copy the plain address into the C buffer and enqueue it.
             std::memcpy(Sender.Plainaddress, Plainaddress.c_str(), Plainaddress.size());
-            std::string Data{ Packetrawdata.begin(), Packetrawdata.end() };
-            Localnetworking::Enqueueframe(Sender, Data);
+            Localnetworking::Enqueueframe(Sender, { Packetrawdata.begin(), Packetrawdata.end() });
             break;
         }
         case Hash::FNV1a_32(MODULENAME "::Default"):
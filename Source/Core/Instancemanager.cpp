@@ -7,125 +7,871 @@
 */
 
 #include "../Stdinclude.hpp"
+#include "../Utility/Thirdparty/json.hpp"
 
 namespace Localnetworking
 {
+    // The exports of a module, resolved once when it's loaded.
+    struct Module_t
+    {
+        void *Handle;
+        IServer *(*Createserver)(const char *Hostname);
+        bool Declareshosts;
+        std::string Archive;
+
+        // Hot reloading, retired modules are unloaded once their servers are idle.
+        std::string Source;
+        int64_t Modified;
+        bool Retired;
+        size_t Idleticks;
+    };
+
+    // A server created by a module, forgotten once it has neither a host nor a socket.
+    struct Liveserver_t
+    {
+        IServer *Server;
+        size_t Module;
+        size_t Idleticks;
+    };
+
+    // Hostname rules mapped to modules; exact, suffix ("*.example.com") and regex ("regex:...").
+    struct Routingtable_t
+    {
+        std::unordered_map<std::string /* Hostname */, size_t /* Module */> Exact;
+        std::unordered_map<std::string /* .Suffix */, size_t /* Module */> Suffix;
+        std::vector<std::pair<std::regex, size_t /* Module */>> Patterns;
+    };
+
+    // A resolved host, interned once and indexed by name, fake IP and server.
+    struct Hostentry_t
+    {
+        std::string Hostname;
+        uint32_t Address;
+        IServer *Server;
+    };
+
+    // Immutable once published, writers copy it so readers never block or see it change.
+    struct Hostregistry_t
+    {
+        std::vector<std::shared_ptr<const Hostentry_t>> Entries;
+        std::unordered_map<std::string_view /* Hostname */, const Hostentry_t *> Hostnameindex;
+        std::unordered_map<uint32_t /* IPv4 */, const Hostentry_t *> Addressindex;
+        std::unordered_map<IServer *, const Hostentry_t *> Serverindex;
+        std::vector<IServer *> Servers;
+    };
+
     constexpr const char *Moduleextension = sizeof(void *) == sizeof(uint32_t) ?  ".LN32" : ".LN64";
-    std::unordered_map<std::string /* IP */, std::string /* Hostname */> Resolvercache;
-    std::unordered_map<std::string /* Hostname */, void * /* Module */> Modulecache;
-    std::unordered_map<std::string /* Hostname */, IServer *> Serverinstances;
-    std::vector<std::string /* Hostname */> Blacklist;
-    std::vector<void * /* Module */> Networkmodules;
+    constexpr std::chrono::minutes Blacklisttimeout{ 5 };
+    std::shared_ptr<const Hostregistry_t> Hostregistry = std::make_shared<const Hostregistry_t>();
+    std::unordered_map<std::string /* Hostname */, std::chrono::steady_clock::time_point /* Expiry */> Blacklist;
+    std::vector<Liveserver_t> Liveservers;
+    std::deque<Module_t> Networkmodules;
+    Routingtable_t Routingtable;
+    std::mutex Maintenanceguard;
+    std::mutex Routingguard;
+    std::mutex Loaderguard;
+    std::mutex Serverguard;
+    std::mutex Hostguard;
+
+    // Parse a dotted IPv4 address into the in_addr layout.
+    bool Parseaddress(std::string_view Plainaddress, uint32_t &Address)
+    {
+        uint8_t Bytes[4]{};
+        size_t Index = 0, Digits = 0, Value = 0;
+
+        for (auto Char : Plainaddress)
+        {
+            if (Char == '.')
+            {
+                if (!Digits || Index == 3) return false;
+                Bytes[Index++] = uint8_t(Value);
+                Digits = Value = 0;
+                continue;
+            }
+
+            if (Char < '0' || Char > '9' || ++Digits > 3) return false;
+            Value = Value * 10 + (Char - '0');
+            if (Value > 255) return false;
+        }
+
+        if (!Digits || Index != 3) return false;
+        Bytes[3] = uint8_t(Value);
+        std::memcpy(&Address, Bytes, sizeof(Address));
+        return true;
+    }
+
+    // Find the registered host by hostname or dotted fake IP.
+    const Hostentry_t *Findhost(const Hostregistry_t &Registry, std::string_view Hostname)
+    {
+        auto Entry = Registry.Hostnameindex.find(Hostname);
+        if (Entry != Registry.Hostnameindex.end()) return Entry->second;
+
+        uint32_t Address;
+        if (!Parseaddress(Hostname, Address)) return nullptr;
+
+        auto Addressentry = Registry.Addressindex.find(Address);
+        if (Addressentry != Registry.Addressindex.end()) return Addressentry->second;
+        return nullptr;
+    }
+    std::shared_ptr<const Hostregistry_t> Currentregistry()
+    {
+        return std::atomic_load(&Hostregistry);
+    }
+    std::shared_ptr<const std::vector<IServer *>> Serverinstances()
+    {
+        auto Registry = Currentregistry();
+        return { Registry, &Registry->Servers };
+    }
+
+    // Hostnames are case-insensitive.
+    std::string Lowercase(std::string_view Input)
+    {
+        std::string Result(Input);
+        for (auto &Char : Result) Char = char(std::tolower(uint8_t(Char)));
+        return Result;
+    }
+
+    // Add a module-declared rule to the routing table, returns false if it was invalid or already claimed.
+    bool Addroute(std::string_view Pattern, size_t Module)
+    {
+        std::lock_guard<std::mutex> Lock(Routingguard);
+
+        if (0 == Pattern.compare(0, 6, "regex:"))
+        {
+            try { Routingtable.Patterns.emplace_back(std::regex(std::string(Pattern.substr(6)), std::regex::icase | std::regex::optimize), Module); }
+            catch (const std::regex_error &) { Infoprint(va("Invalid hostname pattern \"%s\".", Pattern.data())); return false; }
+            return true;
+        }
+        else if (0 == Pattern.compare(0, 2, "*."))
+        {
+            return Routingtable.Suffix.emplace(Lowercase(Pattern.substr(1)), Module).second;
+        }
+        else
+        {
+            return Routingtable.Exact.emplace(Lowercase(Pattern), Module).second;
+        }
+    }
+
+    // Find the module for a hostname, the cost depends on the name rather than the table.
+    bool Findroute(std::string_view Hostname, size_t &Module)
+    {
+        auto Name = Lowercase(Hostname);
+
+        auto Exact = Routingtable.Exact.find(Name);
+        if (Exact != Routingtable.Exact.end())
+        {
+            Module = Exact->second;
+            return true;
+        }
+
+        // Try every parent domain, longest first.
+        for (auto Offset = Name.find('.'); Offset != std::string::npos; Offset = Name.find('.', Offset + 1))
+        {
+            auto Suffix = Routingtable.Suffix.find(Name.substr(Offset));
+            if (Suffix != Routingtable.Suffix.end())
+            {
+                Module = Suffix->second;
+                return true;
+            }
+        }
+
+        for (auto &Item : Routingtable.Patterns)
+        {
+            if (std::regex_match(Name, Item.first))
+            {
+                Module = Item.second;
+                return true;
+            }
+        }
+
+        return false;
+    }
 
     // Platform functionality.
     std::string Temporarydir();
     void *Loadmodule(std::string_view Modulename);
     void *Getfunction(void *Modulehandle, std::string_view Function);
+    void Unloadmodule(void *Modulehandle);
+
+    // Resolve the exports and any hostnames the module declares, called with the loader locked.
+    bool Registermodule(void *Handle, std::string_view Source)
+    {
+        if (!Handle) return false;
+
+        Module_t Module{ Handle, nullptr, false, {}, std::string(Source), Filetime(Source.data()), false, 0 };
+        Module.Createserver = (IServer * (*)(const char *))Getfunction(Handle, "Createserver");
+        if (!Module.Createserver)
+        {
+            Infoprint("A module is missing the Createserver export, ignoring it.");
+            return false;
+        }
+
+        // Optional export, a nullterminated list of hostname rules the module serves.
+        auto Hostnames = (const char **(*)())Getfunction(Handle, "Hostnames");
+        if (Hostnames)
+        {
+            // Modules without any usable rule are still asked about unknown hosts.
+            auto List = Hostnames();
+            for (size_t i = 0; List && List[i]; ++i)
+                Module.Declareshosts |= Addroute(List[i], Networkmodules.size());
+        }
+
+        Networkmodules.push_back(Module);
+        return true;
+    }
+
+    // Read the hostnames an archive publishes, safe to call from any thread.
+    bool Readmanifest(std::string_view Modulename, Package::Archivehandle &Archive, std::vector<std::string> &Hostnames)
+    {
+        auto Manifest = Package::Read(Archive, "Manifest.json");
+        if (Manifest.empty()) return false;
+
+        try
+        {
+            auto Parsed = nlohmann::json::parse(Manifest);
+            Hostnames = Parsed.at("Hostnames").get<std::vector<std::string>>();
+        }
+        catch (const std::exception &)
+        {
+            Infoprint(va("Invalid manifest in %s, loading it directly.", Modulename.data()));
+            return false;
+        }
+
+        return true;
+    }
+
+    // Modules with a manifest are only extracted and loaded once one of their hosts is resolved, called with the loader locked.
+    bool Registermanifest(std::string_view Modulename, const std::vector<std::string> &Hostnames)
+    {
+        // A module that can never be routed to is loaded eagerly instead.
+        bool Routed = false;
+        for (auto &Item : Hostnames) Routed |= Addroute(Item, Networkmodules.size());
+        if (!Routed) return false;
+
+        auto Source = "./Plugins/" + std::string(Modulename);
+        Networkmodules.push_back({ nullptr, nullptr, true, std::string(Modulename), Source, Filetime(Source), false, 0 });
+        return true;
+    }
+
+    // Extract the module from its archive, reusing a previous extraction if unchanged.
+    std::string Extractmodule(Package::Archivehandle &Archive, bool *Cached)
+    {
+        auto List = Package::Findfiles(Archive, Moduleextension);
+        if (0 == List.size()) return {};
+
+        // Name the extracted file after the content so unchanged modules are reused.
+        uint32_t Checksum = 0; size_t Size = 0;
+        Package::Fileinfo(Archive, List[0], &Checksum, &Size);
+        auto Stem = List[0].substr(0, List[0].size() - std::strlen(Moduleextension));
+        auto Cachename = va("%s_%08X_%zu%s", Stem.c_str(), Checksum, Size, Moduleextension);
+        auto Path = Temporarydir() + "/" + Cachename;
+
+        // Only inflate if there's no complete copy on disk.
+        *Cached = Size && Filesize(Path) == Size;
+        if (!*Cached)
+        {
+            Writefile(Path + ".tmp", Package::Read(Archive, List[0]));
+            std::remove(Path.c_str());
+            std::rename((Path + ".tmp").c_str(), Path.c_str());
+        }
+
+        return Path;
+    }
+    std::string Extractmodule(std::string_view Modulename, bool *Cached)
+    {
+        auto Archive = Package::Loadarchive("./Plugins/" + std::string(Modulename));
+        auto Path = Extractmodule(Archive, Cached);
+        Package::Closearchive(Archive);
+        return Path;
+    }
+
+    // Remove older extractions of the module at Path, named <Stem>_<8 hex>_<digits><ext> by Extractmodule.
+    void Removestaleextractions(std::string_view Path)
+    {
+        auto Cachename = std::string(Path.substr(Path.find_last_of("/\\") + 1));
+        auto Sizeoffset = Cachename.find_last_of('_');
+        if (Sizeoffset == std::string::npos || Sizeoffset < 9) return;
+
+        auto Stem = Cachename.substr(0, Sizeoffset - 9);
+        auto Extensionsize = std::strlen(Moduleextension);
+        auto isStale = [&](const std::string &Item) -> bool
+        {
+            // In-flight .tmp files and other modules never match.
+            if (Item == Cachename || Item.size() < Stem.size() + 11 + Extensionsize) return false;
+            if (0 != Item.compare(0, Stem.size(), Stem) || Item[Stem.size()] != '_' || Item[Stem.size() + 9] != '_') return false;
+            if (0 != Item.compare(Item.size() - Extensionsize, Extensionsize, Moduleextension)) return false;
+
+            for (size_t i = Stem.size() + 1; i < Stem.size() + 9; ++i)
+                if (!std::isxdigit(uint8_t(Item[i]))) return false;
+            for (size_t i = Stem.size() + 10; i < Item.size() - Extensionsize; ++i)
+                if (!std::isdigit(uint8_t(Item[i]))) return false;
+
+            return true;
+        };
+
+        for (auto &Item : Findfiles(Temporarydir(), Moduleextension))
+        {
+            if (isStale(Item)) std::remove((Temporarydir() + "/" + Item).c_str());
+        }
+    }
+
+    double Elapsedms(std::chrono::steady_clock::time_point Start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+    }
+
+    // Get the modules factory, loading it on first use.
+    IServer *(*Resolvemodule(size_t Index))(const char *)
+    {
+        std::lock_guard<std::mutex> Lock(Loaderguard);
+        auto &Module = Networkmodules[Index];
+        if (Module.Createserver || Module.Archive.empty()) return Module.Createserver;
+
+        auto Loadstart = std::chrono::steady_clock::now();
+        bool Cached = false;
+        auto Path = Extractmodule(Module.Archive, &Cached);
+        if (!Path.empty()) Removestaleextractions(Path);
+        Module.Handle = Path.empty() ? nullptr : Loadmodule(Path);
+        if (Module.Handle) Module.Createserver = (IServer * (*)(const char *))Getfunction(Module.Handle, "Createserver");
+
+        // Don't retry broken modules.
+        if (!Module.Createserver) Infoprint(va("Failed to load %s on demand.", Module.Archive.c_str()));
+        else Infoprint(va("Loaded %s on demand in %.2f ms%s.", Module.Archive.c_str(), Elapsedms(Loadstart), Cached ? " (from cache)" : ""));
+        Module.Archive.clear();
+
+        return Module.Createserver;
+    }
 
     // Create a new instance of a server.
     IServer *Createserver(std::string_view Hostname)
     {
-        // Don't waste time on blacklisted hostnames.
-        if (Blacklist.end() != std::find(Blacklist.begin(), Blacklist.end(), Hostname))
-            return nullptr;
+        // Don't waste time on recently blacklisted hostnames.
+        auto Now = std::chrono::steady_clock::now();
+        Routingguard.lock();
+        {
+            auto Blacklisted = Blacklist.find(Hostname.data());
+            if (Blacklisted != Blacklist.end())
+            {
+                if (Now < Blacklisted->second)
+                {
+                    Routingguard.unlock();
+                    return nullptr;
+                }
+                Blacklist.erase(Blacklisted);
+            }
+        }
+        Routingguard.unlock();
 
         // Create a new server-instance.
-        auto Lambda = [&](void *Module) -> IServer *
+        auto Registry = Currentregistry();
+        auto Host = Findhost(*Registry, Hostname);
+        const std::string Resolvedname = Host ? Host->Hostname : "";
+        auto Lambda = [&](size_t Module) -> IServer *
         {
-            // Find the export in the module.
-            auto pFunction = Getfunction(Module, "Createserver");
-            if (!pFunction) return nullptr;
+            auto Function = Resolvemodule(Module);
+            if (!Function) return nullptr;
 
             // Ask the module to create a new instance for the hostname.
-            auto Function = (IServer * (*)(const char *))pFunction;
-            auto Result = Function(Resolvercache[Hostname.data()].c_str());
+            auto Result = Function(Resolvedname.c_str());
             if(!Result) Result = Function(Hostname.data());
+            if (!Result) return nullptr;
+
+            // Track the owner so the module isn't unloaded while the server is in use.
+            Serverguard.lock();
+            {
+                Liveservers.push_back({ Result, Module, 0 });
+            }
+            Serverguard.unlock();
+
+            // Let servers that support it wake the pollthread when they send.
+            auto Extended = dynamic_cast<IServer2 *>(Result);
+            if (Extended) Extended->Installsignal(Signalpollthread);
 
             return Result;
         };
 
-        // Check if we have cached which module is associated.
-        auto Cache = Modulecache.find(Hostname.data());
-        if (Cache != Modulecache.end())
+        // Check if we have cached, or the module declared, which module is associated.
+        size_t Module;
+        Routingguard.lock();
+        bool Routed = Findroute(Hostname, Module) || (!Resolvedname.empty() && Findroute(Resolvedname, Module));
+        Routingguard.unlock();
+        if (Routed)
         {
-            return Lambda(Cache->second);
+            return Lambda(Module);
         }
 
-        // Iterate over all the known modules.
-        for (auto &Item : Networkmodules)
+        // Ask the modules that don't declare their hosts.
+        std::vector<size_t> Candidates;
+        Loaderguard.lock();
+        for (size_t i = 0; i < Networkmodules.size(); ++i)
         {
-            auto Server = Lambda(Item);
-            if (Server) return Server;
+            if (!Networkmodules[i].Declareshosts && !Networkmodules[i].Retired)
+                Candidates.push_back(i);
         }
+        Loaderguard.unlock();
 
-        // Blacklist the hostname so we don't spam.
-        Blacklist.push_back(Hostname.data());
+        for (auto i : Candidates)
+        {
+            auto Server = Lambda(i);
+            if (Server)
+            {
+                Routingguard.lock();
+                Routingtable.Exact.emplace(Lowercase(Hostname), i);
+                Routingguard.unlock();
+                return Server;
+            }
+        }
+
+        // Blacklist the hostname for a while so we don't spam.
+        Routingguard.lock();
+        Blacklist[Hostname.data()] = Now + Blacklisttimeout;
+        Routingguard.unlock();
         return nullptr;
     }
-    void Duplicateserver(std::string_view Hostname, IServer *Instance)
+
+    // Associate a server and its fake IP with the hostname, the first registration wins unless replacing.
+    void Registerhost(std::string_view Hostname, uint32_t Address, IServer *Server, bool Replace)
     {
-        Serverinstances.emplace(Hostname, Instance);
+        Hostguard.lock();
+        {
+            // Resolving a known host again keeps the existing server.
+            auto Previous = Findhost(*Currentregistry(), Hostname);
+            if (Previous && !Replace)
+            {
+                Hostguard.unlock();
+                return;
+            }
+
+            auto Registry = std::make_shared<Hostregistry_t>(*Currentregistry());
+            auto Entry = std::make_shared<const Hostentry_t>(Hostentry_t{ std::string(Hostname), Address, Server });
+
+            // Hot reload swaps the server behind the host.
+            if (Previous)
+            {
+                Registry->Hostnameindex.erase(Previous->Hostname);
+                auto Addressentry = Registry->Addressindex.find(Previous->Address);
+                if (Addressentry != Registry->Addressindex.end() && Addressentry->second == Previous) Registry->Addressindex.erase(Addressentry);
+                auto Serverentry = Registry->Serverindex.find(Previous->Server);
+                if (Serverentry != Registry->Serverindex.end() && Serverentry->second == Previous) Registry->Serverindex.erase(Serverentry);
+                Registry->Entries.erase(std::remove_if(Registry->Entries.begin(), Registry->Entries.end(),
+                    [&](const auto &Item) { return Item.get() == Previous; }), Registry->Entries.end());
+
+                // Other hosts sharing the address or server take over the indexes.
+                for (auto &Item : Registry->Entries)
+                {
+                    Registry->Addressindex.emplace(Item->Address, Item.get());
+                    Registry->Serverindex.emplace(Item->Server, Item.get());
+                }
+            }
+
+            // Shared addresses and servers keep pointing at the first host.
+            Registry->Entries.push_back(Entry);
+            Registry->Hostnameindex.emplace(Entry->Hostname, Entry.get());
+            Registry->Addressindex.emplace(Address, Entry.get());
+            Registry->Serverindex.emplace(Server, Entry.get());
+
+            Registry->Servers.clear();
+            for (auto &Item : Registry->Serverindex) Registry->Servers.push_back(Item.first);
+
+            std::atomic_store(&Hostregistry, std::shared_ptr<const Hostregistry_t>(Registry));
+        }
+        Hostguard.unlock();
     }
 
     // Find a server by criteria.
     IServer *Findserver(std::string_view Hostname)
     {
-        auto Entry = Serverinstances.find(Hostname.data());
-        if(Entry != Serverinstances.end())
-            return Entry->second;
-        else
-            return nullptr;
+        auto Registry = Currentregistry();
+        auto Entry = Findhost(*Registry, Hostname);
+        return Entry ? Entry->Server : nullptr;
+    }
+    IServer *Findserver(uint32_t Address)
+    {
+        auto Registry = Currentregistry();
+        auto Entry = Registry->Addressindex.find(Address);
+        return Entry != Registry->Addressindex.end() ? Entry->second->Server : nullptr;
     }
 
     // Reverse lookup and debugging information.
-    void Forceresolvehost(std::string IP, std::string Hostname)
+    std::string Findhostname(IServer *Server)
     {
-        Resolvercache.emplace(IP, Hostname);
+        auto Registry = Currentregistry();
+        auto Entry = Registry->Serverindex.find(Server);
+        return Entry != Registry->Serverindex.end() ? Entry->second->Hostname : "";
     }
-    std::string Findhostname(IServer *Server)
+    std::string Findhostname(uint32_t Address)
     {
-        for (auto &Item : Serverinstances)
-        {
-            if (Item.second == Server)
-                return Item.first;
-        }
-
-        return "";
+        auto Registry = Currentregistry();
+        auto Entry = Registry->Addressindex.find(Address);
+        return Entry != Registry->Addressindex.end() ? Entry->second->Hostname : "";
+    }
+    uint32_t Findaddress(IServer *Server)
+    {
+        auto Registry = Currentregistry();
+        auto Entry = Registry->Serverindex.find(Server);
+        return Entry != Registry->Serverindex.end() ? Entry->second->Address : 0;
     }
 
     // Initialize the modules.
     void Loadallmodules()
     {
+        auto Starttime = std::chrono::steady_clock::now();
+
         // Enumerate all modules in the directory.
         auto Modulenames = Findfiles("./Plugins/", ".Localnet");
         Infoprint(va("Found %i modules.", Modulenames.size()));
 
-        // Extract and load the plugins.
-        for (auto &Item : Modulenames)
+        // Read the archives in parallel as inflating is the slow part, modules with a manifest are not extracted.
+        struct Extracted_t { std::vector<std::string> Hostnames; bool Manifest; std::string Path; double Extractiontime; bool Cached; };
+        std::vector<Extracted_t> Extracted(Modulenames.size());
+        std::atomic<size_t> Nextmodule{ 0 };
+        auto Worker = [&]() -> void
         {
-            auto Archive = Package::Loadarchive("./Plugins/" + Item);
-            auto List = Package::Findfiles(Archive, Moduleextension);
-            if (0 == List.size()) continue;
+            for (size_t i = Nextmodule++; i < Modulenames.size(); i = Nextmodule++)
+            {
+                auto Extractionstart = std::chrono::steady_clock::now();
+                Package::Archivehandle Archive = nullptr;
+                auto &Entry = Extracted[i];
 
-            // Remove any already extracted plugin.
-            auto Path = Temporarydir() + "/" + List[0];
-            std::remove(Path.c_str());
+                try
+                {
+                    Archive = Package::Loadarchive("./Plugins/" + Modulenames[i]);
+                    Entry.Manifest = Readmanifest(Modulenames[i], Archive, Entry.Hostnames);
+                    if (!Entry.Manifest) Entry.Path = Extractmodule(Archive, &Entry.Cached);
+                }
+                catch (const std::exception &)
+                {
+                    Infoprint(va("Failed to read %s.", Modulenames[i].c_str()));
+                }
 
-            // Write the file to disk.
-            Writefile(Path, Package::Read(Archive, List[0]));
+                Package::Closearchive(Archive);
+                Entry.Extractiontime = Elapsedms(Extractionstart);
+            }
+        };
 
-            // Load the module from disk.
-            Networkmodules.push_back(Loadmodule(Path.c_str()));
+        std::vector<std::thread> Workers;
+        auto Workercount = std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), Modulenames.size());
+        for (size_t i = 0; i < Workercount; ++i) Workers.emplace_back(Worker);
+        for (auto &Item : Workers) Item.join();
+
+        // Index modules that publish their hostnames, the rest are loaded now as the loader is not reentrant.
+        size_t Deferred = 0;
+        for (size_t i = 0; i < Extracted.size(); ++i)
+        {
+            if (Extracted[i].Manifest)
+            {
+                Loaderguard.lock();
+                bool Registered = Registermanifest(Modulenames[i], Extracted[i].Hostnames);
+                Loaderguard.unlock();
+
+                if (Registered) { Deferred++; continue; }
+                Extracted[i].Path = Extractmodule(Modulenames[i], &Extracted[i].Cached);
+            }
+            if (Extracted[i].Path.empty()) continue;
+
+            // Hosts may already be resolving, so only the registration is done with the loader locked.
+            auto Loadstart = std::chrono::steady_clock::now();
+            auto Handle = Loadmodule(Extracted[i].Path.c_str());
+            Loaderguard.lock();
+            Registermodule(Handle, "./Plugins/" + Modulenames[i]);
+            Loaderguard.unlock();
+            Infoprint(va("Loaded %s in %.2f ms (%.2f ms %s).", Modulenames[i].c_str(),
+                Extracted[i].Extractiontime + Elapsedms(Loadstart), Extracted[i].Extractiontime,
+                Extracted[i].Cached ? "from cache" : "extracting"));
+        }
+
+        Infoprint(va("Deferred loading of %zu modules until their hosts are resolved.", Deferred));
+
+        // Clean up older versions once no worker is writing to the directory.
+        for (auto &Item : Extracted)
+        {
+            if (!Item.Path.empty()) Removestaleextractions(Item.Path);
         }
 
         // Sideload any developer plugin.
         #if defined(_WIN32)
         if(Fileexists("./Plugins/Developermodule.dll"))
-            Networkmodules.push_back(Loadmodule("./Plugins/Developermodule"));
+        {
+            auto Handle = Loadmodule("./Plugins/Developermodule");
+            Loaderguard.lock();
+            Registermodule(Handle, "./Plugins/Developermodule.dll");
+            Loaderguard.unlock();
+        }
         #else
         if (Fileexists("./Plugins/Developerplugin.so"))
-            Networkmodules.push_back(Loadmodule("./Plugins/Developermodule"));
+        {
+            auto Handle = Loadmodule("./Plugins/Developermodule");
+            Loaderguard.lock();
+            Registermodule(Handle, "./Plugins/Developerplugin.so");
+            Loaderguard.unlock();
+        }
         #endif
+
+        Infoprint(va("Loaded all modules in %.2f ms.", Elapsedms(Starttime)));
+    }
+
+    // Load a new version of the module next to the old one, called with the loader locked.
+    bool Replacemodule(size_t Index)
+    {
+        auto Source = Networkmodules[Index].Source;
+        auto Extension = Source.substr(Source.find_last_of('.'));
+
+        if (Extension == ".Localnet")
+        {
+            auto Modulename = Source.substr(std::strlen("./Plugins/"));
+            std::vector<std::string> Hostnames;
+            bool Cached = false;
+
+            bool Manifest = false;
+            std::string Path;
+
+            auto Archive = Package::Loadarchive(Source);
+            try
+            {
+                Manifest = Readmanifest(Modulename, Archive, Hostnames);
+                if (!Manifest) Path = Extractmodule(Archive, &Cached);
+            }
+            catch (const std::exception &)
+            {
+                Package::Closearchive(Archive);
+                throw;
+            }
+            Package::Closearchive(Archive);
+
+            if (Manifest && Registermanifest(Modulename, Hostnames)) return true;
+            if (Manifest) Path = Extractmodule(Modulename, &Cached);
+            if (Path.empty()) return false;
+
+            Removestaleextractions(Path);
+            return Registermodule(Loadmodule(Path), Source);
+        }
+
+        // The loader returns the existing handle for a known path, so load a copy.
+        auto Path = va("%s/Developermodule_%lld%s", Temporarydir().c_str(), (long long)Filetime(Source), Extension.c_str());
+        Writefile(Path, Readfile(Source));
+        return Registermodule(Loadmodule(Path), Source);
+    }
+    void Reloadmodule(size_t Index)
+    {
+        std::vector<std::shared_ptr<const Hostentry_t>> Hosts;
+        Loaderguard.lock();
+        {
+            // Take the old module's routes out so the replacement can claim the same hosts.
+            Routingtable_t Previous;
+            Routingguard.lock();
+            {
+                auto Move = [&](auto &From, auto &To)
+                {
+                    for (auto It = From.begin(); It != From.end();)
+                    {
+                        if (It->second != Index) { ++It; continue; }
+                        To.emplace(std::move(*It));
+                        It = From.erase(It);
+                    }
+                };
+                Move(Routingtable.Exact, Previous.Exact);
+                Move(Routingtable.Suffix, Previous.Suffix);
+                for (auto &Item : Routingtable.Patterns)
+                    if (Item.second == Index) Previous.Patterns.push_back(Item);
+                Routingtable.Patterns.erase(std::remove_if(Routingtable.Patterns.begin(), Routingtable.Patterns.end(),
+                    [&](const auto &Item) { return Item.second == Index; }), Routingtable.Patterns.end());
+            }
+            Routingguard.unlock();
+
+            // A half-copied or broken archive throws, which must not take the process down.
+            bool Replaced = false;
+            auto Replacement = Networkmodules.size();
+            try { Replaced = Replacemodule(Index); }
+            catch (const std::exception &) { Replaced = false; }
+
+            if (!Replaced)
+            {
+                Routingguard.lock();
+                {
+                    Routingtable.Exact.insert(Previous.Exact.begin(), Previous.Exact.end());
+                    Routingtable.Suffix.insert(Previous.Suffix.begin(), Previous.Suffix.end());
+                    Routingtable.Patterns.insert(Routingtable.Patterns.end(), Previous.Patterns.begin(), Previous.Patterns.end());
+                }
+                Routingguard.unlock();
+
+                // Wait for the next change rather than retrying a broken build.
+                Networkmodules[Index].Modified = Filetime(Networkmodules[Index].Source);
+                Infoprint(va("Failed to reload %s.", Networkmodules[Index].Source.c_str()));
+                Loaderguard.unlock();
+                return;
+            }
+
+            auto &Module = Networkmodules[Index];
+            Module.Retired = true;
+            Infoprint(va("Reloaded %s as module %zu.", Module.Source.c_str(), Replacement));
+
+            // Give previously unknown hosts another chance.
+            Routingguard.lock();
+            {
+                Blacklist.clear();
+            }
+            Routingguard.unlock();
+
+            // Find the resolved hosts served by the old module.
+            std::vector<IServer *> Servers;
+            Serverguard.lock();
+            {
+                for (auto &Item : Liveservers)
+                    if (Item.Module == Index) Servers.push_back(Item.Server);
+            }
+            Serverguard.unlock();
+
+            auto Registry = Currentregistry();
+            for (auto &Item : Registry->Entries)
+            {
+                if (Servers.end() != std::find(Servers.begin(), Servers.end(), Item->Server))
+                    Hosts.push_back(Item);
+            }
+        }
+        Loaderguard.unlock();
+
+        // New connections get instances from the new module, open sockets keep the old one until closed.
+        for (auto &Item : Hosts)
+        {
+            auto Server = Createserver(Item->Hostname);
+            if (Server) Registerhost(Item->Hostname, Item->Address, Server, true);
+        }
+    }
+    // Every host of a shared server has its own entry while Serverindex only keeps the first, so check them all.
+    std::vector<IServer *> Registeredservers(const Hostregistry_t &Registry)
+    {
+        std::vector<IServer *> Result;
+        Result.reserve(Registry.Entries.size());
+        for (auto &Item : Registry.Entries) Result.push_back(Item->Server);
+        std::sort(Result.begin(), Result.end());
+        return Result;
+    }
+    void Unloadidle()
+    {
+        auto Registered = Registeredservers(*Currentregistry());
+        std::lock_guard<std::mutex> Lock(Loaderguard);
+
+        for (size_t i = 0; i < Networkmodules.size(); ++i)
+        {
+            auto &Module = Networkmodules[i];
+            if (!Module.Retired || !Module.Handle) continue;
+
+            std::vector<IServer *> Servers;
+            Serverguard.lock();
+            {
+                for (auto &Item : Liveservers)
+                    if (Item.Module == i) Servers.push_back(Item.Server);
+            }
+            Serverguard.unlock();
+
+            // Busy while any host entry points at one of its servers, or one of them owns a socket.
+            bool Idle = std::none_of(Servers.begin(), Servers.end(), [&](IServer *Server)
+            {
+                return std::binary_search(Registered.begin(), Registered.end(), Server) || Countsockets(Server);
+            });
+
+            // Stay idle for a full tick so in-flight calls into the module have returned.
+            Module.Idleticks = Idle ? Module.Idleticks + 1 : 0;
+            if (Module.Idleticks < 2) continue;
+
+            // Stop maintaining the servers and wait for a running pass to return before unmapping them.
+            Serverguard.lock();
+            {
+                Liveservers.erase(std::remove_if(Liveservers.begin(), Liveservers.end(),
+                    [&](const auto &Item) { return Item.Module == i; }), Liveservers.end());
+            }
+            Serverguard.unlock();
+            Maintenanceguard.lock();
+            Maintenanceguard.unlock();
+
+            Infoprint(va("Unloading the previous version of %s.", Module.Source.c_str()));
+            Unloadmodule(Module.Handle);
+            Module.Handle = nullptr;
+            Module.Createserver = nullptr;
+        }
+    }
+
+    // Housekeeping for every server that's still loaded, called from the pollthread so it never takes the loader lock.
+    void Maintainservers()
+    {
+        std::lock_guard<std::mutex> Lock(Maintenanceguard);
+
+        std::vector<Liveserver_t> Servers;
+        Serverguard.lock();
+        {
+            Servers = Liveservers;
+        }
+        Serverguard.unlock();
+
+        for (auto &Item : Servers)
+        {
+            auto Extended = dynamic_cast<IServer2 *>(Item.Server);
+            if (Extended) Extended->onMaintenance();
+        }
+
+        auto Registered = Registeredservers(*Currentregistry());
+        std::vector<IServer *> Unused;
+        for (auto &Item : Servers)
+        {
+            if (!std::binary_search(Registered.begin(), Registered.end(), Item.Server) && 0 == Countsockets(Item.Server))
+                Unused.push_back(Item.Server);
+        }
+        std::sort(Unused.begin(), Unused.end());
+
+        // Forget servers that stayed unused for two passes, as a new server is tracked just before its host is registered.
+        Serverguard.lock();
+        {
+            for (auto &Item : Liveservers)
+                Item.Idleticks = std::binary_search(Unused.begin(), Unused.end(), Item.Server) ? Item.Idleticks + 1 : 0;
+
+            Liveservers.erase(std::remove_if(Liveservers.begin(), Liveservers.end(),
+                [](const auto &Item) { return Item.Idleticks >= 2; }), Liveservers.end());
+        }
+        Serverguard.unlock();
+    }
+
+    // Poll the modules on disk and reload any that changed.
+    void Modulewatcher()
+    {
+        // Size and time of changed modules, reloaded once they stay the same for a poll so copies have finished.
+        std::unordered_map<size_t, std::pair<size_t, int64_t>> Pending;
+
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(2));
+
+            std::vector<size_t> Changed;
+            Loaderguard.lock();
+            for (size_t i = 0; i < Networkmodules.size(); ++i)
+            {
+                auto &Module = Networkmodules[i];
+                if (Module.Retired || Module.Source.empty()) continue;
+
+                auto Modified = Filetime(Module.Source);
+                if (!Modified || Modified == Module.Modified)
+                {
+                    Pending.erase(i);
+                    continue;
+                }
+
+                auto Current = std::make_pair(Filesize(Module.Source), Modified);
+                auto Entry = Pending.find(i);
+                if (Entry != Pending.end() && Entry->second == Current)
+                {
+                    Changed.push_back(i);
+                    Pending.erase(Entry);
+                }
+                else Pending[i] = Current;
+            }
+            Loaderguard.unlock();
+
+            for (auto Index : Changed) Reloadmodule(Index);
+            Unloadidle();
+        }
+    }
+    void Startmodulewatcher()
+    {
+        std::thread(Modulewatcher).detach();
     }
 
     // Platform functionality.
@@ -145,6 +891,10 @@ namespace Localnetworking
     {
         return GetProcAddress(HMODULE(Modulehandle), Functionname.data());
     }
+    void Unloadmodule(void *Modulehandle)
+    {
+        FreeLibrary(HMODULE(Modulehandle));
+    }
 
     #else
 
@@ -172,6 +922,10 @@ namespace Localnetworking
     {
         return dlsym(Modulehandle, Functionname.data());
     }
+    void Unloadmodule(void *Modulehandle)
+    {
+        dlclose(Modulehandle);
+    }
 
     #endif
 }
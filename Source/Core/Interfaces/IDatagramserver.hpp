@@ -9,65 +9,343 @@
 #pragma once
 #include "IServer.hpp"
 #include <algorithm>
+#include <unordered_map>
+#include <cstring>
 #include <string>
-#include <queue>
+#include <vector>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <mutex>
 
-struct IDatagramserver : IServer
+// A pooled packet buffer, linked into the queue.
+struct Packetnode_t
 {
-    std::queue<std::string> Packetqueue;
+    std::atomic<Packetnode_t *> Next{ nullptr };
+    bool Haspeer = false;
+    std::string Data;
+    Address_t Peer;
+};
+
+// Lock-free multi-producer, single-consumer queue (Vyukov) with a small node pool.
+struct Packetqueue_t
+{
+    static constexpr size_t Poolsize = 64;
+    std::atomic<Packetnode_t *> Pool[Poolsize]{};
+    std::atomic<Packetnode_t *> Head;
+    Packetnode_t *Tail;
+    Packetnode_t Stub;
+
+    Packetqueue_t() : Head(&Stub), Tail(&Stub) {}
+    ~Packetqueue_t()
+    {
+        while (auto Node = Pop()) delete Node;
+        for (auto &Slot : Pool) delete Slot.load();
+    }
+
+    // Producers take a recycled node if there's one available.
+    Packetnode_t *Allocate()
+    {
+        for (auto &Slot : Pool)
+        {
+            if (!Slot.load(std::memory_order_relaxed)) continue;
+            auto Node = Slot.exchange(nullptr, std::memory_order_acquire);
+            if (Node) return Node;
+        }
+
+        return new Packetnode_t();
+    }
+    void Recycle(Packetnode_t *Node)
+    {
+        // Keep the buffer capacity unless it's unusually large.
+        Node->Data.clear();
+        if (Node->Data.capacity() > 64 * 1024) Node->Data.shrink_to_fit();
+
+        for (auto &Slot : Pool)
+        {
+            Packetnode_t *Expected = nullptr;
+            if (Slot.compare_exchange_strong(Expected, Node, std::memory_order_release, std::memory_order_relaxed))
+                return;
+        }
+
+        delete Node;
+    }
+
+    // Any thread may push.
+    void Push(Packetnode_t *Node)
+    {
+        Node->Next.store(nullptr, std::memory_order_relaxed);
+        auto Previous = Head.exchange(Node, std::memory_order_acq_rel);
+        Previous->Next.store(Node, std::memory_order_release);
+    }
+
+    // Only the dispatcher may pop, returns nullptr if empty or a push is in progress.
+    Packetnode_t *Pop()
+    {
+        auto Node = Tail;
+        auto Next = Node->Next.load(std::memory_order_acquire);
+
+        // Skip past the stub.
+        if (Node == &Stub)
+        {
+            if (!Next) return nullptr;
+            Tail = Next;
+            Node = Next;
+            Next = Next->Next.load(std::memory_order_acquire);
+        }
+
+        if (Next)
+        {
+            Tail = Next;
+            return Node;
+        }
+
+        // The last node can only be taken once the stub is queued behind it.
+        if (Node != Head.load(std::memory_order_acquire)) return nullptr;
+        Push(&Stub);
+
+        Next = Node->Next.load(std::memory_order_acquire);
+        if (Next)
+        {
+            Tail = Next;
+            return Node;
+        }
+
+        return nullptr;
+    }
+};
+
+// Peers are keyed on the full address and port, the hash only picks the bucket.
+struct Peerhash_t
+{
+    size_t operator()(const Address_t &Peer) const
+    {
+        // FNV1a of the port and address.
+        uint64_t Key = 14695981039346656037u ^ Peer.Port;
+        for (auto Pointer = Peer.Plainaddress; *Pointer; ++Pointer)
+            Key = (Key ^ uint8_t(*Pointer)) * 1099511628211u;
+        return size_t(Key);
+    }
+};
+struct Peerequal_t
+{
+    bool operator()(const Address_t &Left, const Address_t &Right) const
+    {
+        return Left.Port == Right.Port && 0 == std::strncmp(Left.Plainaddress, Right.Plainaddress, sizeof(Left.Plainaddress));
+    }
+};
+
+struct IDatagramserver : IServer2
+{
+    Packetqueue_t Packetqueue;
     Address_t Hostinformation{};
     std::mutex Threadguard;
 
-    // Usercode interaction.
+    // Every address that has sent packets recently, most recent first so the oldest is evicted when full.
+    struct Peer_t
+    {
+        Address_t Address;
+        std::chrono::steady_clock::time_point Seen;
+    };
+    static constexpr size_t Peerlimit = 1024;
+    static constexpr std::chrono::minutes Peertimeout{ 5 };
+    std::unordered_map<Address_t, std::list<Peer_t>::iterator, Peerhash_t, Peerequal_t> Peerindex;
+    std::list<Peer_t> Peers;
+    std::mutex Peerguard;
+
+    // Installed by the host to dispatch new packets without waiting for a poll.
+    void (*Packetsignal)() = nullptr;
+    virtual void Installsignal(void (*Signal)())
+    {
+        Packetsignal = Signal;
+    }
+
+    // Usercode interaction, packets without a peer go to the last sender.
     virtual void Send(std::string Databuffer)
     {
         // Enqueue the packet at the end of the queue.
-        Threadguard.lock();
+        auto Node = Packetqueue.Allocate();
+        Node->Data.swap(Databuffer);
+        Node->Haspeer = false;
+        Packetqueue.Push(Node);
+
+        // Notify the host that there's a packet ready.
+        if (Packetsignal) Packetsignal();
+    }
+    virtual void Send(const void *Databuffer, const uint32_t Datasize)
+    {
+        // Copy into a pooled buffer to avoid allocating.
+        auto Node = Packetqueue.Allocate();
+        Node->Data.assign(reinterpret_cast<const char *>(Databuffer), Datasize);
+        Node->Haspeer = false;
+        Packetqueue.Push(Node);
+
+        // Notify the host that there's a packet ready.
+        if (Packetsignal) Packetsignal();
+    }
+    virtual void Send(const Address_t &Peer, const void *Databuffer, const uint32_t Datasize)
+    {
+        auto Node = Packetqueue.Allocate();
+        Node->Data.assign(reinterpret_cast<const char *>(Databuffer), Datasize);
+        Node->Haspeer = true;
+        Node->Peer = Peer;
+        Packetqueue.Push(Node);
+
+        // Notify the host that there's a packet ready.
+        if (Packetsignal) Packetsignal();
+    }
+    virtual void Send(const Address_t &Peer, std::string Databuffer)
+    {
+        auto Node = Packetqueue.Allocate();
+        Node->Data.swap(Databuffer);
+        Node->Haspeer = true;
+        Node->Peer = Peer;
+        Packetqueue.Push(Node);
+
+        // Notify the host that there's a packet ready.
+        if (Packetsignal) Packetsignal();
+    }
+
+    // Modules implement either callback, the peer-aware one defaults to the legacy one.
+    virtual void onData(const Address_t &Peer, const std::string &Packet)
+    {
+        (void)Peer;
+        onData(Packet);
+    }
+    virtual void onData(const std::string &Packet)
+    {
+        (void)Packet;
+    }
+
+    // A copy of the peer-table, safe to call from onData.
+    std::vector<Address_t> Getpeers()
+    {
+        std::vector<Address_t> Result;
+        std::lock_guard<std::mutex> Lock(Peerguard);
+
+        Result.reserve(Peers.size());
+        for (auto &Item : Peers) Result.push_back(Item.Address);
+        return Result;
+    }
+    void Removeoldestpeer()
+    {
+        // The caller holds the lock.
+        Peerindex.erase(Peers.back().Address);
+        Peers.pop_back();
+    }
+    void Addpeer(const Address_t &Peer)
+    {
+        auto Now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> Lock(Peerguard);
+        auto Entry = Peerindex.find(Peer);
+        if (Entry != Peerindex.end())
         {
-            Packetqueue.push(Databuffer);
+            Entry->second->Seen = Now;
+            Peers.splice(Peers.begin(), Peers, Entry->second);
+            return;
         }
-        Threadguard.unlock();
+
+        if (Peers.size() >= Peerlimit) Removeoldestpeer();
+
+        Peers.push_front({ Peer, Now });
+        Peerindex.emplace(Peer, Peers.begin());
     }
-    virtual void Send(const void *Databuffer, const uint32_t Datasize)
+    void Expirepeers()
     {
-        return Send({ reinterpret_cast<const char *>(Databuffer), Datasize });
+        auto Now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> Lock(Peerguard);
+        while (!Peers.empty() && Now - Peers.back().Seen > Peertimeout)
+            Removeoldestpeer();
     }
-    virtual void onData(const std::string &Packet) = 0;
+
+    // Set once this onPacketread runs, until then onPacketreadall reads through the override.
+    std::atomic<bool> Defaultpacketread{ false };
+    std::vector<char> Packetscratch;
 
     // Returns false if the request could not be completed for any reason.
     virtual bool onPacketread(Address_t &Server, void *Databuffer, uint32_t *Datasize)
     {
-        // If there's no packets, return instantly.
-        if (Packetqueue.empty()) return false;
+        Defaultpacketread = true;
 
         // Verify the pointers, although they should always be valid.
         if (!Databuffer || !Datasize) return false;
 
-        // Copy the packet to the buffer.
-        Threadguard.lock();
+        // If there's no packets, return instantly.
+        auto Node = Packetqueue.Pop();
+        if (!Node) return false;
+
+        // Copy as much data as we can fit in the buffer.
+        *Datasize = std::min(*Datasize, uint32_t(Node->Data.size()));
+        std::memcpy(Databuffer, Node->Data.data(), *Datasize);
+
+        // Set the servers address, either the peer or the last sender.
+        if (Node->Haspeer)
+        {
+            std::memcpy(&Server, &Node->Peer, sizeof(Address_t));
+        }
+        else
         {
-            // Validate the state, unlikely to change.
-            if (!Packetqueue.empty())
+            Threadguard.lock();
             {
-                // Get the first packet in the queue.
-                auto Packet = Packetqueue.front();
-                Packetqueue.pop();
+                std::memcpy(&Server, &Hostinformation, sizeof(Address_t));
+            }
+            Threadguard.unlock();
+        }
 
-                // Copy as much data as we can fit in the buffer.
-                *Datasize = std::min(*Datasize, uint32_t(Packet.size()));
-                std::copy_n(Packet.begin(), *Datasize, reinterpret_cast<char *>(Databuffer));
+        Packetqueue.Recycle(Node);
+        return true;
+    }
+    virtual size_t onPacketreadall(Packetcallback_t Callback, void *Context, size_t Budget)
+    {
+        size_t Count = 0;
+        Address_t Lastsender{};
 
-                // Set the servers address.
-                std::memcpy(&Server, &Hostinformation, sizeof(Address_t));
+        // Modules that override onPacketread, without calling this one, are always polled through it.
+        // Wrappers that do call it should also override onPacketreadall.
+        if (!Defaultpacketread)
+        {
+            if (Packetscratch.empty()) Packetscratch.resize(64 * 1024);
+
+            while (Count < Budget && !Defaultpacketread)
+            {
+                Address_t Sender{};
+                auto Datasize = uint32_t(Packetscratch.size());
+                if (!onPacketread(Sender, Packetscratch.data(), &Datasize)) break;
+
+                Callback(Context, Sender, Packetscratch.data(), Datasize);
+                Count++;
             }
+
+            if (!Defaultpacketread) return Count;
+        }
+
+        Threadguard.lock();
+        {
+            std::memcpy(&Lastsender, &Hostinformation, sizeof(Address_t));
         }
         Threadguard.unlock();
 
-        return true;
+        // Hand out the pooled buffers directly, without truncating.
+        while (Count < Budget)
+        {
+            auto Node = Packetqueue.Pop();
+            if (!Node) break;
+
+            Callback(Context, Node->Haspeer ? Node->Peer : Lastsender, Node->Data.data(), uint32_t(Node->Data.size()));
+            Packetqueue.Recycle(Node);
+            Count++;
+        }
+
+        return Count;
     }
     virtual bool onPacketwrite(const Address_t &Server, const void *Databuffer, const uint32_t Datasize)
     {
+        // Remember the sender for per-peer replies.
+        Addpeer(Server);
+
         // Pass the packet to the usercode callback.
         Threadguard.lock();
         {
@@ -77,7 +355,7 @@ struct IDatagramserver : IServer
             // Create a new string and let the compiler optimize it out.
             auto Pointer = reinterpret_cast<const char *>(Databuffer);
             auto Packet = std::string(Pointer, Datasize);
-            onData(Packet);
+            onData(Server, Packet);
 
             // Ensure that the mutex is locked as usercode is unpredictable.
             auto Discarded = Threadguard.try_lock();
@@ -88,6 +366,12 @@ struct IDatagramserver : IServer
         return true;
     }
 
+    // The host expires idle peers periodically.
+    virtual void onMaintenance()
+    {
+        Expirepeers();
+    }
+
     // Nullsub the unused callbacks.
     virtual void onDisconnect(const size_t Socket)
     {
@@ -106,6 +390,14 @@ struct IDatagramserver : IServer
 
         return false;
     }
+    virtual bool onStreamwait(const size_t Socket, const uint32_t Timeout)
+    {
+        (void)Socket;
+
+        // There's never any stream data, so wait out the timeout.
+        std::this_thread::sleep_for(std::chrono::milliseconds(Timeout));
+        return false;
+    }
     virtual bool onStreamwrite(const size_t Socket, const void *Databuffer, const uint32_t Datasize)
     {
         (void)Socket;
@@ -7,6 +7,7 @@
 */
 
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 // Universal representation of addresses.
@@ -16,6 +17,9 @@ struct Address_t
     char Plainaddress[65];
 };
 
+// Receives each packet when draining a server, the data is only valid during the call.
+using Packetcallback_t = void (*)(void *Context, const Address_t &Server, const void *Databuffer, const uint32_t Datasize);
+
 // The base servertype that all others will derive from.
 // Callbacks return false if there's an error, such as there being no data.
 struct IServer
@@ -30,3 +34,20 @@ struct IServer
     virtual bool onStreamread(const size_t Socket, void *Databuffer, uint32_t *Datasize) = 0;
     virtual bool onStreamwrite(const size_t Socket, const void *Databuffer, const uint32_t Datasize) = 0;
 };
+
+// Extensions that the host discovers with dynamic_cast, so modules built against
+// the plain IServer keep their vtable layout. Never change it once released, derive IServer3.
+struct IServer2 : IServer
+{
+    // The host hands over a callback that wakes its packet dispatch.
+    virtual void Installsignal(void (*Signal)()) = 0;
+
+    // Blocks until onStreamread has data or the timeout (in milliseconds) expires.
+    virtual bool onStreamwait(const size_t Socket, const uint32_t Timeout) = 0;
+
+    // Periodic housekeeping, called by the host about once per second.
+    virtual void onMaintenance() = 0;
+
+    // Reads up to Budget pending packets, returns how many were passed to the callback.
+    virtual size_t onPacketreadall(Packetcallback_t Callback, void *Context, size_t Budget) = 0;
+};
@@ -9,119 +9,442 @@
 #pragma once
 #include <unordered_map>
 #include "IServer.hpp"
+#include <condition_variable>
+#include <shared_mutex>
 #include <algorithm>
+#include <cstring>
 #include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 
-struct IStreamserver : IServer
+// A scatter/gather entry, similar to an iovec.
+struct Constbuffer_t
+{
+    const void *Databuffer;
+    size_t Datasize;
+};
+
+// A chain of chunks so that consuming from the front is O(1) and broadcasts share memory.
+struct Streambuffer_t
+{
+    struct Segment_t
+    {
+        std::shared_ptr<const std::string> Data;
+        std::string *Writable;
+        size_t Offset;
+    };
+
+    // Small writes are coalesced into private chunks up to this size.
+    static constexpr size_t Chunksize = 64 * 1024;
+    std::deque<Segment_t> Segments;
+    size_t Length = 0;
+
+    size_t Size() const
+    {
+        return Length;
+    }
+    void Clear()
+    {
+        Segments.clear();
+        Length = 0;
+    }
+    void Append(const void *Databuffer, const size_t Datasize)
+    {
+        if (0 == Datasize) return;
+        auto Pointer = reinterpret_cast<const char *>(Databuffer);
+
+        // Extend the last chunk if we own it and it has room.
+        if (!Segments.empty() && Segments.back().Writable && Segments.back().Writable->size() + Datasize <= Chunksize)
+        {
+            Segments.back().Writable->append(Pointer, Datasize);
+        }
+        else
+        {
+            auto Buffer = std::make_shared<std::string>(Pointer, Datasize);
+            Segments.push_back({ Buffer, Buffer.get(), 0 });
+        }
+
+        Length += Datasize;
+    }
+    void Appendshared(std::shared_ptr<const std::string> Buffer)
+    {
+        if (!Buffer || Buffer->empty()) return;
+
+        Length += Buffer->size();
+        Segments.push_back({ std::move(Buffer), nullptr, 0 });
+    }
+    size_t Peek(void *Databuffer, size_t Datasize) const
+    {
+        Datasize = std::min(Datasize, Length);
+        auto Pointer = reinterpret_cast<char *>(Databuffer);
+        size_t Copied = 0;
+
+        for (auto &Item : Segments)
+        {
+            if (Copied == Datasize) break;
+
+            auto Count = std::min(Datasize - Copied, Item.Data->size() - Item.Offset);
+            std::memcpy(Pointer + Copied, Item.Data->data() + Item.Offset, Count);
+            Copied += Count;
+        }
+
+        return Copied;
+    }
+    size_t Consume(size_t Datasize)
+    {
+        Datasize = std::min(Datasize, Length);
+        Length -= Datasize;
+
+        for (auto Remaining = Datasize; Remaining;)
+        {
+            auto &Item = Segments.front();
+            auto Count = std::min(Remaining, Item.Data->size() - Item.Offset);
+
+            Item.Offset += Count;
+            Remaining -= Count;
+
+            if (Item.Offset == Item.Data->size())
+                Segments.pop_front();
+        }
+
+        return Datasize;
+    }
+    size_t Read(void *Databuffer, size_t Datasize)
+    {
+        return Consume(Peek(Databuffer, Datasize));
+    }
+};
+
+// Per-connection state, each direction has its own lock.
+struct Streamconnection_t
+{
+    std::atomic<bool> Validconnection{ false };
+    std::vector<uint8_t> Incomingstream;
+    Streambuffer_t Outgoingstream;
+    size_t Incomingoffset = 0;
+    std::mutex Incomingguard;
+    std::condition_variable Outgoingsignal;
+    std::mutex Outgoingguard;
+
+    // Flow-control, guarded by the Outgoingguard.
+    std::chrono::steady_clock::time_point Disconnecttime;
+    size_t Highwatermark = 0;
+    size_t Lowwatermark = 0;
+    bool Throttled = false;
+};
+
+struct IStreamserver : IServer2
 {
     // Per socket state-information where the Berkeley socket is the key.
-    std::unordered_map<size_t, std::vector<uint8_t>> Incomingstream;
-    std::unordered_map<size_t, std::vector<uint8_t>> Outgoingstream;
+    std::unordered_map<size_t, std::shared_ptr<Streamconnection_t>> Connections;
+    std::shared_mutex Connectionguard;
+
+    // Legacy members kept for source-compatibility, the base no longer holds the Threadguard.
+    // Validconnection mirrors the per-connection state, the old per-socket streams are gone.
     std::unordered_map<size_t, bool> Validconnection;
     std::mutex Threadguard;
 
+    // Defaults for new connections, output from closed sockets is dropped after the timeout.
+    size_t Highwatermark = 8 * 1024 * 1024;
+    size_t Lowwatermark = 1024 * 1024;
+    std::chrono::milliseconds Lingertimeout{ 30000 };
+
+    // Connections are created on first use and erased once they have lingered, handles are shared.
+    std::shared_ptr<Streamconnection_t> Findconnection(const size_t Socket)
+    {
+        {
+            std::shared_lock<std::shared_mutex> Lock(Connectionguard);
+            auto Entry = Connections.find(Socket);
+            if (Entry != Connections.end()) return Entry->second;
+        }
+
+        std::unique_lock<std::shared_mutex> Lock(Connectionguard);
+        auto &Entry = Connections[Socket];
+        if (!Entry)
+        {
+            Entry = std::make_shared<Streamconnection_t>();
+            Entry->Disconnecttime = std::chrono::steady_clock::now();
+            Entry->Highwatermark = Highwatermark;
+            Entry->Lowwatermark = Lowwatermark;
+        }
+        return Entry;
+    }
+
+    // Flow-control, Send still accepts data above the high watermark so usercode should check isWritable.
+    virtual void onWritable(const size_t Socket)
+    {
+        (void)Socket;
+    }
+    virtual bool isWritable(const size_t Socket)
+    {
+        auto Connection = Findconnection(Socket);
+        std::lock_guard<std::mutex> Lock(Connection->Outgoingguard);
+        return Connection->Outgoingstream.Size() < Connection->Highwatermark;
+    }
+    virtual void Setwatermarks(const size_t Socket, const size_t High, const size_t Low)
+    {
+        auto Connection = Findconnection(Socket);
+        std::lock_guard<std::mutex> Lock(Connection->Outgoingguard);
+        Connection->Highwatermark = High;
+        Connection->Lowwatermark = std::min(Low, High);
+    }
+    void Evictlingering()
+    {
+        auto Now = std::chrono::steady_clock::now();
+        std::vector<size_t> Evicted;
+        std::unique_lock<std::shared_mutex> Lock(Connectionguard);
+
+        // Drop closed connections, and any output the application has not read, after the timeout.
+        for (auto Item = Connections.begin(); Item != Connections.end();)
+        {
+            bool Expired = false;
+            if (Item->second->Validconnection == false)
+            {
+                std::lock_guard<std::mutex> Outgoinglock(Item->second->Outgoingguard);
+                Expired = Now - Item->second->Disconnecttime > Lingertimeout;
+                if (Expired)
+                {
+                    Item->second->Outgoingstream.Clear();
+                    Item->second->Throttled = false;
+                }
+            }
+
+            if (Expired)
+            {
+                Evicted.push_back(Item->first);
+                Item = Connections.erase(Item);
+            }
+            else ++Item;
+        }
+        Lock.unlock();
+
+        Threadguard.lock();
+        {
+            for (auto &Item : Evicted)
+                Validconnection.erase(Item);
+        }
+        Threadguard.unlock();
+    }
+
     // Usercode interaction.
-    virtual void Send(const size_t Socket, const void *Databuffer, const uint32_t Datasize)
+    virtual void Send(const size_t Socket, const Constbuffer_t *Buffers, const size_t Count)
     {
-        auto Lambda = [&](const size_t lSocket) -> void
+        // If there is a socket, just enqueue the pieces to its stream.
+        if (0 != Socket)
         {
-            // Enqueue the data at the end of the stream.
-            Threadguard.lock();
+            auto Connection = Findconnection(Socket);
+
+            Connection->Outgoingguard.lock();
             {
-                auto Pointer = reinterpret_cast<const uint8_t *>(Databuffer);
-                std::copy_n(Pointer, Datasize, std::back_inserter(Outgoingstream[lSocket]));
+                for (size_t i = 0; i < Count; ++i)
+                    Connection->Outgoingstream.Append(Buffers[i].Databuffer, Buffers[i].Datasize);
+
+                if (Connection->Outgoingstream.Size() >= Connection->Highwatermark)
+                    Connection->Throttled = true;
             }
-            Threadguard.unlock();
-        };
+            Connection->Outgoingguard.unlock();
 
-        // If there is a socket, just enqueue to its stream.
-        if (0 != Socket) return Lambda(Socket);
+            Connection->Outgoingsignal.notify_all();
+            return;
+        }
 
-        // Else we treat it as a broadcast request.
-        for (auto &Item : Validconnection)
-            if (Item.second == true)
-                Lambda(Item.first);
+        // Else we treat it as a broadcast request and share a single buffer.
+        auto Shared = std::make_shared<std::string>();
+        for (size_t i = 0; i < Count; ++i)
+            Shared->append(reinterpret_cast<const char *>(Buffers[i].Databuffer), Buffers[i].Datasize);
+        Broadcast(std::move(Shared));
+    }
+    virtual void Send(const size_t Socket, const void *Databuffer, const uint32_t Datasize)
+    {
+        Constbuffer_t Buffer{ Databuffer, Datasize };
+        return Send(Socket, &Buffer, 1);
+    }
+    virtual void Broadcast(std::shared_ptr<const std::string> Databuffer)
+    {
+        std::vector<std::shared_ptr<Streamconnection_t>> Receivers;
+        {
+            std::shared_lock<std::shared_mutex> Lock(Connectionguard);
+            for (auto &Item : Connections)
+                if (Item.second->Validconnection == true)
+                    Receivers.push_back(Item.second);
+        }
+
+        // Every connection references the same buffer.
+        for (auto &Item : Receivers)
+        {
+            Item->Outgoingguard.lock();
+            {
+                Item->Outgoingstream.Appendshared(Databuffer);
+
+                if (Item->Outgoingstream.Size() >= Item->Highwatermark)
+                    Item->Throttled = true;
+            }
+            Item->Outgoingguard.unlock();
+
+            Item->Outgoingsignal.notify_all();
+        }
     }
     virtual void Send(const size_t Socket, std::string Databuffer)
     {
         return Send(Socket, Databuffer.data(), uint32_t(Databuffer.size()));
     }
+
+    // Incremental callback for the unconsumed bytes, returns how many were consumed.
+    // Modules that return Unhandled get the whole stream through onData, which stays required.
+    static constexpr size_t Unhandled = size_t(-1);
+    virtual size_t onStreamdata(const size_t Socket, const uint8_t *Databuffer, const size_t Datasize)
+    {
+        (void)Socket;
+        (void)Datasize;
+        (void)Databuffer;
+
+        return Unhandled;
+    }
     virtual void onData(const size_t Socket, std::vector<uint8_t> &Stream) = 0;
 
     // Stream-based IO for protocols such as TCP.
     virtual void onDisconnect(const size_t Socket)
     {
-        Threadguard.lock();
+        auto Connection = Findconnection(Socket);
+
+        // Start the lingering timeout for the outgoing stream before it can be swept.
+        Connection->Outgoingguard.lock();
+        {
+            Connection->Disconnecttime = std::chrono::steady_clock::now();
+        }
+        Connection->Outgoingguard.unlock();
+
+        Connection->Incomingguard.lock();
         {
             // Clear the incoming stream, but keep the outgoing.
-            Incomingstream[Socket].clear();
-            Incomingstream[Socket].shrink_to_fit();
+            Connection->Incomingstream.clear();
+            Connection->Incomingstream.shrink_to_fit();
+            Connection->Incomingoffset = 0;
 
             // Set the connection-state.
+            Connection->Validconnection = false;
+        }
+        Connection->Incomingguard.unlock();
+
+        Threadguard.lock();
+        {
             Validconnection[Socket] = false;
         }
         Threadguard.unlock();
     }
     virtual void onConnect(const size_t Socket, const uint16_t Port)
     {
-        Threadguard.lock();
+        auto Connection = Findconnection(Socket);
+
+        // Clear the streams to be ready for new data.
+        Connection->Incomingguard.lock();
+        Connection->Outgoingguard.lock();
         {
-            // Clear the streams to be ready for new data.
-            Incomingstream[Socket].clear();
-            Outgoingstream[Socket].clear();
+            Connection->Incomingstream.clear();
+            Connection->Outgoingstream.Clear();
+            Connection->Incomingoffset = 0;
+            Connection->Throttled = false;
 
             // Set the connection-state.
+            Connection->Validconnection = true;
+        }
+        Connection->Outgoingguard.unlock();
+        Connection->Incomingguard.unlock();
+
+        Threadguard.lock();
+        {
             Validconnection[Socket] = true;
         }
         Threadguard.unlock();
     }
     virtual bool onStreamread(const size_t Socket, void *Databuffer, uint32_t *Datasize)
     {
-        // To support lingering sockets, we transmit data even if the socket is disconnected.
-        if (0 == Outgoingstream[Socket].size()) return false;
-
         // Verify the pointers, although they should always be valid.
         if (!Databuffer || !Datasize) return false;
 
-        // Copy the stream to the buffer.
-        Threadguard.lock();
+        // To support lingering sockets, we transmit data even if the socket is disconnected.
+        auto Connection = Findconnection(Socket);
+        bool Writable = false;
         {
-            // Validate the state, unlikely to change.
-            if (0 != Outgoingstream[Socket].size())
+            std::lock_guard<std::mutex> Lock(Connection->Outgoingguard);
+            if (0 == Connection->Outgoingstream.Size()) return false;
+
+            // Copy as much data as we can fit in the buffer.
+            *Datasize = uint32_t(Connection->Outgoingstream.Read(Databuffer, *Datasize));
+
+            // Resume a throttled producer once the stream has drained.
+            if (Connection->Throttled && Connection->Outgoingstream.Size() <= Connection->Lowwatermark)
             {
-                // Copy as much data as we can fit in the buffer.
-                *Datasize = std::min(*Datasize, uint32_t(Outgoingstream[Socket].size()));
-                std::copy_n(Outgoingstream[Socket].begin(), *Datasize, reinterpret_cast<char *>(Databuffer));
-                Outgoingstream[Socket].erase(Outgoingstream[Socket].begin(), Outgoingstream[Socket].begin() + *Datasize);
+                Connection->Throttled = false;
+                Writable = Connection->Validconnection;
             }
         }
-        Threadguard.unlock();
 
+        // Notify usercode without holding the lock, as it's likely to Send.
+        if (Writable) onWritable(Socket);
         return true;
     }
+    virtual bool onStreamwait(const size_t Socket, const uint32_t Timeout)
+    {
+        auto Connection = Findconnection(Socket);
+        std::unique_lock<std::mutex> Lock(Connection->Outgoingguard);
+
+        // Woken by Send as soon as data is available.
+        return Connection->Outgoingsignal.wait_for(Lock, std::chrono::milliseconds(Timeout),
+            [&]() { return 0 != Connection->Outgoingstream.Size(); });
+    }
     virtual bool onStreamwrite(const size_t Socket, const void *Databuffer, const uint32_t Datasize)
     {
         // If there is no valid connection, we just ignore the data.
-        if (Validconnection[Socket] == false) return false;
+        auto Connection = Findconnection(Socket);
+        if (Connection->Validconnection == false) return false;
 
-        // Append the data to the stream and notify usercode.
-        Threadguard.lock();
+        // Append the data to the stream and notify usercode, which may Send on the same socket.
+        std::lock_guard<std::mutex> Lock(Connection->Incomingguard);
+        auto &Stream = Connection->Incomingstream;
+        auto Pointer = reinterpret_cast<const uint8_t *>(Databuffer);
+        Stream.insert(Stream.end(), Pointer, Pointer + Datasize);
+
+        // Offer only the bytes that the module has not consumed yet.
+        auto Unconsumed = Stream.size() - Connection->Incomingoffset;
+        auto Consumed = onStreamdata(Socket, Stream.data() + Connection->Incomingoffset, Unconsumed);
+        if (Consumed == Unhandled)
         {
-            auto Pointer = reinterpret_cast<const uint8_t *>(Databuffer);
-            std::copy_n(Pointer, Datasize, std::back_inserter(Incomingstream[Socket]));
-            onData(Socket, Incomingstream[Socket]);
+            onData(Socket, Stream);
+            return true;
+        }
 
-            // Ensure that the mutex is locked as usercode is unpredictable.
-            auto Discarded = Threadguard.try_lock();
-            (void)Discarded;
+        // Advance the offset and only compact the stream once half of it is stale.
+        Connection->Incomingoffset += std::min(Consumed, Unconsumed);
+        if (Connection->Incomingoffset == Stream.size())
+        {
+            Stream.clear();
+            Connection->Incomingoffset = 0;
+        }
+        else if (Connection->Incomingoffset >= Stream.size() / 2)
+        {
+            Stream.erase(Stream.begin(), Stream.begin() + Connection->Incomingoffset);
+            Connection->Incomingoffset = 0;
         }
-        Threadguard.unlock();
 
         return true;
     }
 
+    // The host sweeps lingering connections periodically.
+    virtual void onMaintenance()
+    {
+        Evictlingering();
+    }
+
     // Nullsub the unused callbacks.
+    virtual void Installsignal(void (*Signal)())
+    {
+        (void)Signal;
+    }
     virtual bool onPacketread(Address_t &Server, void *Databuffer, uint32_t *Datasize)
     {
         (void)Server;
@@ -130,6 +453,14 @@ struct IStreamserver : IServer
 
         return false;
     }
+    virtual size_t onPacketreadall(Packetcallback_t Callback, void *Context, size_t Budget)
+    {
+        (void)Budget;
+        (void)Context;
+        (void)Callback;
+
+        return 0;
+    }
     virtual bool onPacketwrite(const Address_t &Server, const void *Databuffer, const uint32_t Datasize)
     {
         (void)Server;
@@ -14,36 +14,62 @@
 
 namespace Localnetworking
 {
+    // A packet waiting to be read by the application, shared between all receivers.
+    struct Frame_t { Address_t From; std::shared_ptr<const std::string> Data; };
+
+    // What to discard when a sockets frame queue is full.
+    enum class Overflowpolicy { DROPOLDEST = 0, DROPNEWEST = 1 };
+    struct Framestatistics_t { size_t Queued; size_t Dropped; size_t Highwater; };
+
     // Create a new instance of a server.
     IServer *Createserver(std::string_view Hostname);
-    void Duplicateserver(std::string_view Hostname, IServer *Instance);
+    void Registerhost(std::string_view Hostname, uint32_t Address, IServer *Server, bool Replace = false);
 
     // Find a server by criteria.
     IServer *Findserver(size_t Socket);
+    IServer *Findserver(uint32_t Address);
     IServer *Findserver(std::string_view Hostname);
+    std::shared_ptr<const std::vector<IServer *>> Serverinstances();
 
     // Manage filters for packet-based IO.
     void Addfilter(size_t Socket, Address_t Filter);
-    std::vector<Address_t> &Getfilters(size_t Socket);
+    std::vector<Address_t> Getfilters(size_t Socket);
+    bool Hasfilters(size_t Socket);
+    void Removefilters(size_t Socket);
 
     // Manage the internal sockets.
     bool isInternalsocket(size_t Socket);
-    std::vector<size_t> Internalsockets();
+    std::shared_ptr<const std::vector<size_t>> Internalsockets();
     void Createsocket(IServer *Server, size_t Socket);
     void Destroysocket(IServer *Server, size_t Socket);
+    size_t Countsockets(IServer *Server);
     size_t Findinternalsocket(Address_t Server, size_t Offset);
+    std::vector<size_t> Findinternalsockets(Address_t Server);
 
     // Map packets to and from the internal lists.
-    void Enqueueframe(Address_t From, std::string &Packet);
+    void Enqueueframe(Address_t From, std::string Packet);
     bool Dequeueframe(size_t Socket, Address_t &From, std::string &Packet);
+    size_t Dequeueframes(size_t Socket, Frame_t *Frames, size_t Count);
+    bool Peekframe(size_t Socket, Frame_t &Frame);
+    bool Waitforframe(size_t Socket, uint32_t Timeout);
+    bool Waitforstream(IServer *Server, size_t Socket, uint32_t Timeout);
+
+    // Bound the memory used by sockets that are not read.
+    void Setframelimit(size_t Socket, size_t Limit, Overflowpolicy Policy);
+    Framestatistics_t Getframestatistics(size_t Socket);
+    void Clearframes(size_t Socket);
 
     // Reverse lookup and debugging information.
-    void Forceresolvehost(std::string IP, std::string Hostname);
     std::string Findhostname(IServer *Server);
+    std::string Findhostname(uint32_t Address);
+    uint32_t Findaddress(IServer *Server);
 
     // Initialize the modules and datagram IO.
+    void Signalpollthread();
     void Startpollthread();
+    void Maintainservers();
     void Loadallmodules();
+    void Startmodulewatcher();
 
     // Initialize the platform hooks.
     void Addplatform(std::function<void()> Callback);
@@ -11,176 +11,475 @@
 namespace Localnetworking
 {
     #define Address Server.Plainaddress
-    using Frame_t = struct { Address_t From; std::string Data; };
 
-    extern std::unordered_map<std::string /* Hostname */, IServer *> Serverinstances;
+    // Frames are sharded by socket so readers and writers rarely contend.
+    constexpr size_t Frameshards = 16;
+    constexpr size_t Defaultframelimit = 1024;
+    struct Socketframes_t
+    {
+        std::queue<Frame_t> Frames;
+        size_t Limit = Defaultframelimit;
+        Overflowpolicy Policy = Overflowpolicy::DROPOLDEST;
+        size_t Highwater = 0;
+        size_t Dropped = 0;
+    };
+    struct Frameshard_t
+    {
+        std::unordered_map<size_t /* Socket */, Socketframes_t> Queues;
+        std::condition_variable Signal;
+        std::mutex Threadguard;
+    };
+
+    // Filters indexed by port, split into exact and wildcard addresses.
+    struct Portfilter_t
+    {
+        std::unordered_map<std::string /* Address */, std::vector<size_t>> Exact;
+        std::vector<size_t> Wildcard;
+    };
+
     std::unordered_map<size_t /* Socket */, std::vector<Address_t>> Filters;
-    std::unordered_map<size_t /* Socket */, std::queue<Frame_t>> Framequeue;
-    std::unordered_map<IServer *, std::vector<size_t>> Connectedsockets;
+    std::unordered_map<uint16_t /* Port */, Portfilter_t> Portfilters;
+    std::shared_mutex Filterguard;
+    Frameshard_t Framequeue[Frameshards];
+    std::unordered_map<size_t /* Socket */, IServer *> Socketregistry;
+    std::shared_ptr<const std::vector<size_t>> Socketsnapshot;
+    std::mutex Registryguard;
 
     // Find a server by criteria.
     IServer *Findserver(size_t Socket)
     {
-        for (auto &Server : Connectedsockets)
+        IServer *Result = nullptr;
+
+        Registryguard.lock();
         {
-            for (auto &Berkeley : Server.second)
-            {
-                if (Berkeley == Socket)
-                    return Server.first;
-            }
+            auto Entry = Socketregistry.find(Socket);
+            if (Entry != Socketregistry.end())
+                Result = Entry->second;
         }
+        Registryguard.unlock();
 
-        return nullptr;
+        return Result;
     }
 
     // Manage filters for packet-based IO.
     void Addfilter(size_t Socket, Address_t Filter)
     {
-        auto Entry = &Filters[Socket];
-        for (auto &Item : *Entry)
+        Filterguard.lock();
         {
-            if (std::strcmp(Item.Plainaddress, Filter.Plainaddress) == 0
-                && Item.Port == Filter.Port)
-                return;
+            bool Duplicate = false;
+            auto Entry = &Filters[Socket];
+            for (auto &Item : *Entry)
+            {
+                if (std::strcmp(Item.Plainaddress, Filter.Plainaddress) == 0
+                    && Item.Port == Filter.Port)
+                {
+                    Duplicate = true;
+                    break;
+                }
+            }
+
+            if (!Duplicate)
+            {
+                Entry->push_back(Filter);
+
+                // Index the filter by port for the packet-routing.
+                auto Bucket = &Portfilters[Filter.Port];
+                if (0 == std::strcmp(Filter.Plainaddress, "0.0.0.0") || 0 == std::strcmp(Filter.Plainaddress, "::"))
+                    Bucket->Wildcard.push_back(Socket);
+                else
+                    Bucket->Exact[Filter.Plainaddress].push_back(Socket);
+            }
         }
-        Entry->push_back(Filter);
+        Filterguard.unlock();
+    }
+    std::vector<Address_t> Getfilters(size_t Socket)
+    {
+        std::shared_lock<std::shared_mutex> Lock(Filterguard);
+
+        auto Entry = Filters.find(Socket);
+        if (Entry == Filters.end()) return {};
+        return Entry->second;
+    }
+    bool Hasfilters(size_t Socket)
+    {
+        std::shared_lock<std::shared_mutex> Lock(Filterguard);
+        return Filters.count(Socket) != 0;
     }
-    std::vector<Address_t> &Getfilters(size_t Socket)
+    void Removefilters(size_t Socket)
     {
-        return Filters[Socket];
+        Filterguard.lock();
+        {
+            auto Entry = Filters.find(Socket);
+            if (Entry != Filters.end())
+            {
+                for (auto &Item : Entry->second)
+                {
+                    auto Bucket = Portfilters.find(Item.Port);
+                    if (Bucket == Portfilters.end()) continue;
+
+                    auto Erase = [&](std::vector<size_t> &Sockets)
+                    {
+                        Sockets.erase(std::remove(Sockets.begin(), Sockets.end(), Socket), Sockets.end());
+                    };
+
+                    Erase(Bucket->second.Wildcard);
+                    auto Exact = Bucket->second.Exact.find(Item.Plainaddress);
+                    if (Exact != Bucket->second.Exact.end())
+                    {
+                        Erase(Exact->second);
+                        if (Exact->second.empty()) Bucket->second.Exact.erase(Exact);
+                    }
+
+                    if (Bucket->second.Exact.empty() && Bucket->second.Wildcard.empty())
+                        Portfilters.erase(Bucket);
+                }
+
+                Filters.erase(Entry);
+            }
+        }
+        Filterguard.unlock();
     }
 
     // Manage the internal sockets.
     bool isInternalsocket(size_t Socket)
     {
-        for (auto &Entry : Connectedsockets)
+        return nullptr != Findserver(Socket);
+    }
+    std::shared_ptr<const std::vector<size_t>> Internalsockets()
+    {
+        // Readers keep their snapshot alive even if a newer one is published.
+        auto Sockets = std::atomic_load(&Socketsnapshot);
+        if (!Sockets) Sockets = std::make_shared<const std::vector<size_t>>();
+        return Sockets;
+    }
+    void Publishsockets()
+    {
+        // Only called with the Registryguard held.
+        auto Sockets = std::make_shared<std::vector<size_t>>();
+        Sockets->reserve(Socketregistry.size());
+        for (auto &Item : Socketregistry)
+            Sockets->push_back(Item.first);
+
+        std::atomic_store(&Socketsnapshot, std::shared_ptr<const std::vector<size_t>>(std::move(Sockets)));
+    }
+    void Createsocket(IServer *Server, size_t Socket)
+    {
+        // A socket belongs to the last server it was associated with.
+        Registryguard.lock();
+        {
+            auto Result = Socketregistry.insert_or_assign(Socket, Server);
+            if (Result.second) Publishsockets();
+        }
+        Registryguard.unlock();
+    }
+    void Destroysocket(IServer *Server, size_t Socket)
+    {
+        bool Removed = false;
+
+        // Only remove the entry if it's still owned by this server.
+        Registryguard.lock();
         {
-            for (auto &Berkeley : Entry.second)
+            auto Entry = Socketregistry.find(Socket);
+            if (Entry != Socketregistry.end() && Entry->second == Server)
             {
-                if (Berkeley == Socket)
-                {
-                    return true;
-                }
+                Socketregistry.erase(Entry);
+                Publishsockets();
+                Removed = true;
             }
         }
+        Registryguard.unlock();
 
-        return false;
+        // Stop routing to the socket first, then release any frames the application never read.
+        if (Removed) Removefilters(Socket);
+        if (Removed) Clearframes(Socket);
     }
-    std::vector<size_t> Internalsockets()
+    size_t Countsockets(IServer *Server)
     {
-        static std::vector<size_t> Sockets;
-        static int64_t Timestamp = 0;
+        size_t Result = 0;
 
-        // Throttle the updating.
-        if (Timestamp + 5 > time(NULL)) return Sockets;
-        Timestamp = time(NULL);
-        Sockets.clear();
+        Registryguard.lock();
+        {
+            for (auto &Item : Socketregistry)
+                if (Item.second == Server) ++Result;
+        }
+        Registryguard.unlock();
 
-        /*
-            BUG(Convery):
-            Race-condition:
-            Sockets.push_back(Item);
-        */
+        return Result;
+    }
+    size_t Findinternalsocket(Address_t Server, size_t Offset)
+    {
+        auto Sockets = Findinternalsockets(Server);
+        if (Offset < Sockets.size()) return Sockets[Offset];
+        return 0;
+    }
+    std::vector<size_t> Matchfilters(const Address_t &Server)
+    {
+        // Only called with the Filterguard held.
+        std::vector<size_t> Sockets;
 
-        // Get all connected sockets.
-        for (auto &List : Connectedsockets)
-            for(auto &Item : List.second)
-                Sockets.push_back(Item);
+        auto Bucket = Portfilters.find(Server.Port);
+        if (Bucket != Portfilters.end())
+        {
+            auto Exact = Bucket->second.Exact.find(Address);
+            if (Exact != Bucket->second.Exact.end())
+                Sockets.insert(Sockets.end(), Exact->second.begin(), Exact->second.end());
 
-        // Remove duplicates.
+            Sockets.insert(Sockets.end(), Bucket->second.Wildcard.begin(), Bucket->second.Wildcard.end());
+        }
+
+        // A socket may be bound to both the address and a wildcard.
         std::sort(Sockets.begin(), Sockets.end());
-        auto Last = std::unique(Sockets.begin(), Sockets.end());
-        Sockets.erase(Last, Sockets.end());
+        Sockets.erase(std::unique(Sockets.begin(), Sockets.end()), Sockets.end());
 
         return Sockets;
     }
-    void Createsocket(IServer *Server, size_t Socket)
+    std::vector<size_t> Findinternalsockets(Address_t Server)
     {
-        auto Entry = &Connectedsockets[Server];
-        for (auto &Item : *Entry)
-        {
-            if (Item == Socket)
-                return;
-        }
-        Entry->push_back(Socket);
+        std::shared_lock<std::shared_mutex> Lock(Filterguard);
+        return Matchfilters(Server);
     }
-    void Destroysocket(IServer *Server, size_t Socket)
+
+    // Map packets to and from the internal lists.
+    Frameshard_t &Findshard(size_t Socket)
+    {
+        // Windows sockets are multiples of 4, so mix in the lower bits.
+        return Framequeue[((Socket >> 2) ^ Socket) % Frameshards];
+    }
+    void Enqueueframe(Address_t From, std::string Packet)
     {
-        for (auto &Item : Connectedsockets[Server])
+        // Hold the filters until queued, so Destroysocket can't clear a queue that is then recreated.
+        std::shared_lock<std::shared_mutex> Lock(Filterguard);
+
+        // Frames that match no filter are dropped, nothing reads them.
+        auto Sockets = Matchfilters(From);
+        if (Sockets.empty()) return;
+
+        // All receivers share the same immutable payload.
+        auto Payload = std::make_shared<const std::string>(std::move(Packet));
+
+        for (auto &Socket : Sockets)
         {
-            if (Item == Socket)
+            auto &Shard = Findshard(Socket);
+
+            Shard.Threadguard.lock();
             {
-                Item = 0;
-                break;
+                auto Entry = &Shard.Queues[Socket];
+
+                // Make room, or discard the frame, when the queue is full.
+                if (Entry->Frames.size() >= Entry->Limit)
+                {
+                    Entry->Dropped++;
+                    if (Entry->Policy == Overflowpolicy::DROPOLDEST && !Entry->Frames.empty())
+                        Entry->Frames.pop();
+                }
+
+                if (Entry->Frames.size() < Entry->Limit)
+                {
+                    Entry->Frames.push({ From, Payload });
+                    Entry->Highwater = std::max(Entry->Highwater, Entry->Frames.size());
+                }
             }
+            Shard.Threadguard.unlock();
+
+            // Sockets share the shard, so wake all readers.
+            Shard.Signal.notify_all();
         }
     }
-    size_t Findinternalsocket(Address_t Server, size_t Offset)
+    bool Dequeueframe(size_t Socket, Address_t &From, std::string &Packet)
     {
-        for(auto &Collection : Filters)
+        Frame_t Frame;
+        if (0 == Dequeueframes(Socket, &Frame, 1)) return false;
+
+        Packet = *Frame.Data;
+        From = Frame.From;
+        return true;
+    }
+    size_t Dequeueframes(size_t Socket, Frame_t *Frames, size_t Count)
+    {
+        auto &Shard = Findshard(Socket);
+        size_t Result = 0;
+
+        // Move as many frames as we can fit in a single lock.
+        Shard.Threadguard.lock();
         {
-            for(auto &Item : Collection.second)
+            auto Entry = Shard.Queues.find(Socket);
+            if (Entry != Shard.Queues.end())
             {
-                if(Item.Port != Server.Port) continue;
-                if(0 != std::strcmp(Item.Plainaddress, Address)
-                && 0 != std::strcmp(Item.Plainaddress, "0.0.0.0")
-                && 0 != std::strcmp(Item.Plainaddress, "::")) continue;
-
-                if(Offset)
+                while (Result < Count && !Entry->second.Frames.empty())
                 {
-                    Offset--;
-                    continue;
+                    Frames[Result++] = std::move(Entry->second.Frames.front());
+                    Entry->second.Frames.pop();
                 }
+            }
+        }
+        Shard.Threadguard.unlock();
 
-                return Collection.first;
+        return Result;
+    }
+    bool Peekframe(size_t Socket, Frame_t &Frame)
+    {
+        auto &Shard = Findshard(Socket);
+        bool Result = false;
+
+        // Copy the next frame without removing it, the payload is shared.
+        Shard.Threadguard.lock();
+        {
+            auto Entry = Shard.Queues.find(Socket);
+            if (Entry != Shard.Queues.end() && !Entry->second.Frames.empty())
+            {
+                Frame = Entry->second.Frames.front();
+                Result = true;
             }
         }
+        Shard.Threadguard.unlock();
 
-        return 0;
+        return Result;
     }
+    bool Waitforstream(IServer *Server, size_t Socket, uint32_t Timeout)
+    {
+        // Servers without IServer2 have no readiness signal, so they are polled.
+        auto Extended = dynamic_cast<IServer2 *>(Server);
+        if (Extended) return Extended->onStreamwait(Socket, Timeout);
 
-    // Map packets to and from the internal lists.
-    void Enqueueframe(Address_t From, std::string &Packet)
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min(Timeout, uint32_t(10))));
+        return false;
+    }
+    bool Waitforframe(size_t Socket, uint32_t Timeout)
     {
-        size_t Socket = 0;
-        size_t Offset = 0;
+        auto &Shard = Findshard(Socket);
+        std::unique_lock<std::mutex> Lock(Shard.Threadguard);
 
-        do
+        return Shard.Signal.wait_for(Lock, std::chrono::milliseconds(Timeout), [&]()
         {
-            Socket = Findinternalsocket(From, Offset++);
-            Framequeue[Socket].push({ From, Packet });
-        } while (Socket != 0);
+            auto Entry = Shard.Queues.find(Socket);
+            return Entry != Shard.Queues.end() && !Entry->second.Frames.empty();
+        });
     }
-    bool Dequeueframe(size_t Socket, Address_t &From, std::string &Packet)
+    void Clearframes(size_t Socket)
     {
-        if (Framequeue[Socket].empty()) return false;
+        auto &Shard = Findshard(Socket);
 
-        auto Frame = Framequeue[Socket].front();
-        Framequeue[Socket].pop();
-        Packet = Frame.Data;
-        From = Frame.From;
-        return true;
+        Shard.Threadguard.lock();
+        {
+            Shard.Queues.erase(Socket);
+        }
+        Shard.Threadguard.unlock();
+    }
+
+    // Bound the memory used by sockets that are not read.
+    void Setframelimit(size_t Socket, size_t Limit, Overflowpolicy Policy)
+    {
+        auto &Shard = Findshard(Socket);
+
+        Shard.Threadguard.lock();
+        {
+            auto Entry = &Shard.Queues[Socket];
+            Entry->Policy = Policy;
+            Entry->Limit = Limit;
+
+            // Trim the queue to the new limit.
+            while (Entry->Frames.size() > Entry->Limit)
+            {
+                Entry->Frames.pop();
+                Entry->Dropped++;
+            }
+        }
+        Shard.Threadguard.unlock();
+    }
+    Framestatistics_t Getframestatistics(size_t Socket)
+    {
+        Framestatistics_t Result{};
+        auto &Shard = Findshard(Socket);
+
+        Shard.Threadguard.lock();
+        {
+            auto Entry = Shard.Queues.find(Socket);
+            if (Entry != Shard.Queues.end())
+            {
+                Result.Queued = Entry->second.Frames.size();
+                Result.Highwater = Entry->second.Highwater;
+                Result.Dropped = Entry->second.Dropped;
+            }
+        }
+        Shard.Threadguard.unlock();
+
+        return Result;
+    }
+
+    // Wake the pollthread when a server has packets available.
+    std::condition_variable Pollsignal;
+    bool Pollpending = false;
+    std::mutex Pollguard;
+
+    void Signalpollthread()
+    {
+        Pollguard.lock();
+        {
+            Pollpending = true;
+        }
+        Pollguard.unlock();
+
+        Pollsignal.notify_one();
     }
 
     // Initialize the datagram IO.
+    void Enqueuecallback(void *Context, const Address_t &Server, const void *Databuffer, const uint32_t Datasize)
+    {
+        (void)Context;
+        Enqueueframe(Server, std::string(reinterpret_cast<const char *>(Databuffer), Datasize));
+    }
     void Datagrampollthread()
     {
-        auto Buffer = std::make_unique<char []>(10240);
-        uint32_t Buffersize = 10240;
+        // Packets per server and wakeup, so one busy server can't starve the rest.
+        constexpr size_t Packetbudget = 256;
+        auto Buffer = std::make_unique<char []>(65536);
+        auto Lastmaintenance = std::chrono::steady_clock::now();
+        bool Backlogged = false;
 
         while(true)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            // Modules that override onPacketread never signal, so keep polling them.
+            if (!Backlogged)
+            {
+                std::unique_lock<std::mutex> Lock(Pollguard);
+                Pollsignal.wait_for(Lock, std::chrono::milliseconds(30), []() { return Pollpending; });
+                Pollpending = false;
+            }
+            Backlogged = false;
 
-            for(auto &Instance : Serverinstances)
+            auto Servers = Serverinstances();
+            for(auto &Instance : *Servers)
             {
-                Buffersize = 10240;
-                Address_t Serveraddress;
-                if(Instance.second->onPacketread(Serveraddress, Buffer.get(), &Buffersize))
+                size_t Count = 0;
+
+                // Servers without IServer2 are read one packet at a time into the shared buffer.
+                auto Extended = dynamic_cast<IServer2 *>(Instance);
+                if (Extended)
+                {
+                    Count = Extended->onPacketreadall(Enqueuecallback, nullptr, Packetbudget);
+                }
+                else
                 {
-                    auto Packet = std::string(Buffer.get(), Buffersize);
-                    Enqueueframe(Serveraddress, Packet);
+                    while (Count < Packetbudget)
+                    {
+                        uint32_t Buffersize = 65536;
+                        Address_t Serveraddress{};
+                        if (!Instance->onPacketread(Serveraddress, Buffer.get(), &Buffersize)) break;
+
+                        Enqueueframe(Serveraddress, std::string(Buffer.get(), Buffersize));
+                        Count++;
+                    }
                 }
+
+                // Come back without waiting if the server had more than its share.
+                if (Count == Packetbudget) Backlogged = true;
+            }
+
+            // Sweep lingering state even when the application stopped using the servers.
+            if (std::chrono::steady_clock::now() - Lastmaintenance > std::chrono::seconds(1))
+            {
+                Lastmaintenance = std::chrono::steady_clock::now();
+                Maintainservers();
             }
         }
     }
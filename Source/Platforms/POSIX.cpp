@@ -0,0 +1,561 @@
+/*
+    License: MIT
+    Notes:
+        Provides an interface-shim for POSIX sockets.
+        The shims interpose libc, so the library has to be preloaded (LD_PRELOAD)
+        or otherwise loaded before libc in the symbol lookup order. When preloaded
+        without the bootstrapper, the first interposed call initializes the library.
+*/
+
+#if !defined(_WIN32)
+#include "../Stdinclude.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <cerrno>
+
+// The bootstrappers entrypoint, in Appmain.cpp.
+extern "C" EXPORT_ATTR void onInitializationStart(bool Reserved);
+
+namespace POSIX
+{
+    // Hooking.
+    // Calls pass straight through to libc until the platform is initialized.
+    std::atomic<bool> Enabled{ false };
+
+    // Macro to call the next definition of the function, i.e. libc.
+    #define CALLPOSIX(_Function, ...) [&]() {                                                   \
+    static auto Pointer = (decltype(&::_Function))dlsym(RTLD_NEXT, #_Function);                 \
+    return Pointer(__VA_ARGS__); }()
+
+    // Set by the constructor when preloaded, other globals may not be constructed yet at that point.
+    std::atomic<bool> Pendinginitialization{ false };
+    __attribute__((constructor)) void Detectpreload()
+    {
+        Dl_info Info{};
+        auto Preload = getenv("LD_PRELOAD");
+        if (!Preload || !dladdr((void *)&Detectpreload, &Info) || !Info.dli_fname) return;
+
+        // LD_PRELOAD may list paths or plain filenames, separated by colons or spaces.
+        std::string_view Self(Info.dli_fname);
+        Self.remove_prefix(Self.find_last_of('/') + 1);
+        for (std::string_view List(Preload); !List.empty();)
+        {
+            auto End = std::min(List.find_first_of(": "), List.size());
+            auto Entry = List.substr(0, End);
+            Entry.remove_prefix(Entry.find_last_of('/') + 1);
+            if (Entry == Self)
+            {
+                Pendinginitialization = true;
+                return;
+            }
+
+            List.remove_prefix(std::min(End + 1, List.size()));
+        }
+    }
+
+    // Without the bootstrapper nothing calls onInitializationStart, so the first shim does.
+    void Initializepreloaded()
+    {
+        if (Pendinginitialization.load(std::memory_order_relaxed) && Pendinginitialization.exchange(false))
+            onInitializationStart(false);
+    }
+
+    // Helpers.
+    // Query the real socket rather than tracking fcntl and setsockopt.
+    bool isBlocking(int Socket, int Flags)
+    {
+        if (Flags & MSG_DONTWAIT) return false;
+
+        auto Descriptorflags = fcntl(Socket, F_GETFL, 0);
+        return Descriptorflags != -1 && !(Descriptorflags & O_NONBLOCK);
+    }
+    bool isDatagram(int Socket)
+    {
+        int Type = 0;
+        socklen_t Length = sizeof(Type);
+        return 0 == getsockopt(Socket, SOL_SOCKET, SO_TYPE, &Type, &Length) && Type == SOCK_DGRAM;
+    }
+
+    // Milliseconds a blocking read may still wait, 0 when it has timed out.
+    uint32_t Remainingtime(int Socket, std::chrono::steady_clock::time_point Start)
+    {
+        timeval Timeout{};
+        socklen_t Length = sizeof(Timeout);
+        if (0 != getsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, &Length)) return 1000;
+
+        auto Total = int64_t(Timeout.tv_sec) * 1000 + Timeout.tv_usec / 1000;
+        if (0 == Total) return 1000;
+
+        auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start).count();
+        return Elapsed >= Total ? 0 : uint32_t(Total - Elapsed);
+    }
+
+    // Only complete IPv4 and IPv6 addresses can name a server, anything else goes straight to libc.
+    bool isInternet(const struct sockaddr *Sockaddr, socklen_t Length)
+    {
+        if (!Sockaddr) return false;
+        if (Sockaddr->sa_family == AF_INET) return Length >= socklen_t(sizeof(sockaddr_in));
+        if (Sockaddr->sa_family == AF_INET6) return Length >= socklen_t(sizeof(sockaddr_in6));
+        return false;
+    }
+
+    std::string Plainaddress(const struct sockaddr *Sockaddr)
+    {
+        char Address[INET6_ADDRSTRLEN]{};
+
+        if (Sockaddr->sa_family == AF_INET6)
+            inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)Sockaddr)->sin6_addr), Address, INET6_ADDRSTRLEN);
+        else
+            inet_ntop(AF_INET, &(((struct sockaddr_in *)Sockaddr)->sin_addr), Address, INET6_ADDRSTRLEN);
+
+        return std::string(Address);
+    }
+    uint16_t Port(const struct sockaddr *Sockaddr)
+    {
+        if (Sockaddr->sa_family == AF_INET6) return ntohs(((struct sockaddr_in6 *)Sockaddr)->sin6_port);
+        else return ntohs(((struct sockaddr_in *)Sockaddr)->sin_port);
+    }
+    Address_t Localaddress(const struct sockaddr *Sockaddr)
+    {
+        Address_t Result{};
+        Result.Port = Port(Sockaddr);
+        auto Address = Plainaddress(Sockaddr);
+        std::memcpy(Result.Plainaddress, Address.c_str(), Address.size());
+
+        return Result;
+    }
+
+    // Write the sender in the family its address parses as, IPv4 is mapped on IPv6 sockets.
+    void Setsender(int Socket, const Address_t &Sender, struct sockaddr *From, socklen_t *Fromlength)
+    {
+        sockaddr_storage Storage{};
+        socklen_t Length = sizeof(sockaddr_in);
+        in6_addr IPv6{};
+        in_addr IPv4{};
+
+        int Domain = AF_INET;
+        socklen_t Domainlength = sizeof(Domain);
+        #if defined(SO_DOMAIN)
+        getsockopt(Socket, SOL_SOCKET, SO_DOMAIN, &Domain, &Domainlength);
+        #endif
+
+        if (1 == inet_pton(AF_INET, Sender.Plainaddress, &IPv4))
+        {
+            if (Domain == AF_INET6)
+            {
+                IPv6.s6_addr[10] = 0xFF;
+                IPv6.s6_addr[11] = 0xFF;
+                std::memcpy(&IPv6.s6_addr[12], &IPv4, sizeof(IPv4));
+            }
+            else
+            {
+                auto Address = (struct sockaddr_in *)&Storage;
+                Address->sin_family = AF_INET;
+                Address->sin_port = htons(Sender.Port);
+                Address->sin_addr = IPv4;
+            }
+        }
+        else
+        {
+            inet_pton(AF_INET6, Sender.Plainaddress, &IPv6);
+            Domain = AF_INET6;
+        }
+
+        if (Domain == AF_INET6)
+        {
+            auto Address = (struct sockaddr_in6 *)&Storage;
+            Address->sin6_family = AF_INET6;
+            Address->sin6_port = htons(Sender.Port);
+            Address->sin6_addr = IPv6;
+            Length = sizeof(sockaddr_in6);
+        }
+
+        // Like libc, truncate to the callers buffer but report the full length.
+        std::memcpy(From, &Storage, std::min(*Fromlength, Length));
+        *Fromlength = Length;
+    }
+
+    // The servers can't put stream data back, so peeked data is kept here until read.
+    std::unordered_map<int, std::string> Peekbuffers;
+    std::mutex Peekguard;
+
+    size_t Readpeeked(int Socket, void *Buffer, size_t Length, bool Keep)
+    {
+        std::lock_guard<std::mutex> Lock(Peekguard);
+
+        auto Entry = Peekbuffers.find(Socket);
+        if (Entry == Peekbuffers.end()) return 0;
+
+        auto Copied = std::min(Length, Entry->second.size());
+        std::memcpy(Buffer, Entry->second.data(), Copied);
+        if (!Keep) Entry->second.erase(0, Copied);
+        if (Entry->second.empty()) Peekbuffers.erase(Entry);
+
+        return Copied;
+    }
+    void Fillpeekbuffer(IServer *Server, int Socket, size_t Length)
+    {
+        std::lock_guard<std::mutex> Lock(Peekguard);
+
+        auto &Peeked = Peekbuffers[Socket];
+        auto Offset = Peeked.size();
+        if (Offset >= Length) return;
+
+        auto Size = uint32_t(std::min(Length - Offset, size_t(UINT32_MAX)));
+        Peeked.resize(Offset + Size);
+        if (!Server->onStreamread(Socket, &Peeked[Offset], &Size)) Size = 0;
+        Peeked.resize(Offset + Size);
+
+        if (Peeked.empty()) Peekbuffers.erase(Socket);
+    }
+
+    // Datagram sockets that called connect() send to that address.
+    std::unordered_map<int, Address_t> Connectedpeers;
+    std::mutex Peerguard;
+
+    // The descriptor may be reused, so forget the per-socket state once it leaves its server.
+    void Forgetsocket(int Socket)
+    {
+        Peekguard.lock();
+        {
+            Peekbuffers.erase(Socket);
+        }
+        Peekguard.unlock();
+
+        Peerguard.lock();
+        {
+            Connectedpeers.erase(Socket);
+        }
+        Peerguard.unlock();
+    }
+
+    // Shims.
+    int Socket(int Domain, int Type, int Protocol)
+    {
+        // The descriptor is always real so that poll, fcntl and friends keep working.
+        auto Result = CALLPOSIX(socket, Domain, Type, Protocol);
+        Debugprint(va("Created socket %i", Result));
+        return Result;
+    }
+    int Bind(int Socket, const struct sockaddr *Name, socklen_t Namelength)
+    {
+        int Result = 0;
+        if (!isInternet(Name, Namelength)) return CALLPOSIX(bind, Socket, Name, Namelength);
+
+        // Create a server if needed.
+        auto Server = Localnetworking::Findserver(Plainaddress(Name));
+        if (!Server) Server = Localnetworking::Createserver(Plainaddress(Name));
+        if (!Server) Result = CALLPOSIX(bind, Socket, Name, Namelength);
+        if (Server) Localnetworking::Createsocket(Server, Socket);
+        Localnetworking::Addfilter(Socket, Localaddress(Name));
+
+        Debugprint(va("Listening on port %u", Port(Name)));
+        return Result;
+    }
+    int Connect(int Socket, const struct sockaddr *Name, socklen_t Namelength)
+    {
+        int Result = 0;
+        if (!isInternet(Name, Namelength)) return CALLPOSIX(connect, Socket, Name, Namelength);
+
+        // Check if we have any server with this socket and disconnect it.
+        auto Server = Localnetworking::Findserver(size_t(Socket));
+        if (Server)
+        {
+            Server->onDisconnect(Socket);
+            Localnetworking::Destroysocket(Server, Socket);
+            Forgetsocket(Socket);
+        }
+
+        // Create a new server instance from the hostname, even if it's the same host.
+        Server = Localnetworking::Createserver(Plainaddress(Name));
+        if (Server) Localnetworking::Createsocket(Server, Socket);
+
+        // Datagram sockets only remember the address, replies are routed through the filters.
+        if (Server && isDatagram(Socket))
+        {
+            auto Address = Localaddress(Name);
+            Localnetworking::Addfilter(Socket, Address);
+
+            Peerguard.lock();
+            {
+                Connectedpeers[Socket] = Address;
+            }
+            Peerguard.unlock();
+        }
+        else if (Server) Server->onConnect(Socket, Port(Name));
+
+        // Ask libc to connect the socket if there's no server.
+        if (!Server) Result = CALLPOSIX(connect, Socket, Name, Namelength);
+
+        // Debug information.
+        Debugprint(va("%s to %s:%u", Server || 0 == Result ? "Connected" : "Failed to connect", Plainaddress(Name).c_str(), Port(Name)));
+        return Server ? 0 : Result;
+    }
+    ssize_t Receivefrom(int Socket, void *Buffer, size_t Length, int Flags, struct sockaddr *From, socklen_t *Fromlength)
+    {
+        // Check if it's a socket associated with our network.
+        if (!Localnetworking::isInternalsocket(Socket))
+            return CALLPOSIX(recvfrom, Socket, Buffer, Length, Flags, From, Fromlength);
+
+        if (!Buffer)
+        {
+            errno = EFAULT;
+            return -1;
+        }
+
+        Localnetworking::Frame_t Frame;
+        auto Start = std::chrono::steady_clock::now();
+        bool Blocking = isBlocking(Socket, Flags);
+        uint32_t Remaining = 1;
+
+        // Check if there's any data on the socket and return that.
+        do
+        {
+            bool Found = (Flags & MSG_PEEK) ? Localnetworking::Peekframe(Socket, Frame) : 1 == Localnetworking::Dequeueframes(Socket, &Frame, 1);
+            if (Found)
+            {
+                auto &Packet = *Frame.Data;
+
+                // Copy the sender information.
+                if (From && Fromlength) Setsender(Socket, Frame.From, From, Fromlength);
+
+                // Copy the data to the buffer and return how much was copied.
+                auto Copied = std::min(Length, Packet.size());
+                std::memcpy(Buffer, Packet.data(), Copied);
+                return ssize_t(Copied);
+            }
+
+            // Wait for the next frame if we are on a blocking socket.
+            if (!Blocking) break;
+            Remaining = Remainingtime(Socket, Start);
+            if (Remaining) Localnetworking::Waitforframe(Socket, Remaining);
+        } while (Remaining);
+
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t Receive(int Socket, void *Buffer, size_t Length, int Flags)
+    {
+        // Find a server associated with this socket and poll.
+        auto Server = Localnetworking::Findserver(size_t(Socket));
+        if (!Server) return CALLPOSIX(recv, Socket, Buffer, Length, Flags);
+
+        if (!Buffer)
+        {
+            errno = EFAULT;
+            return -1;
+        }
+
+        // Connected datagram sockets read frames like recvfrom.
+        if (isDatagram(Socket)) return Receivefrom(Socket, Buffer, Length, Flags, nullptr, nullptr);
+
+        // If we are on a blocking socket, wait until the server has data.
+        auto Start = std::chrono::steady_clock::now();
+        bool Blocking = isBlocking(Socket, Flags);
+        uint32_t Remaining = 1;
+        do
+        {
+            // Peeked data is served first, and peeking reads ahead into it.
+            if (Flags & MSG_PEEK) Fillpeekbuffer(Server, Socket, Length);
+            auto Peeked = Readpeeked(Socket, Buffer, Length, Flags & MSG_PEEK);
+            if (Peeked) return ssize_t(Peeked);
+
+            uint32_t Result = uint32_t(std::min(Length, size_t(UINT32_MAX)));
+            if (!(Flags & MSG_PEEK) && Server->onStreamread(Socket, Buffer, &Result)) return ssize_t(Result);
+            if (!Blocking) break;
+
+            Remaining = Remainingtime(Socket, Start);
+            if (Remaining) Localnetworking::Waitforstream(Server, Socket, Remaining);
+        } while (Remaining);
+
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t Sendpacket(IServer *Server, int Socket, const Address_t &Address, const void *Buffer, size_t Length, int Flags)
+    {
+        // If we are on a blocking socket, poll until successful.
+        auto Size = uint32_t(std::min(Length, size_t(UINT32_MAX)));
+        bool Blocking = isBlocking(Socket, Flags);
+        do
+        {
+            if (Server->onPacketwrite(Address, Buffer, Size)) return ssize_t(Size);
+            if (Blocking) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        } while (Blocking);
+
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t Send(int Socket, const void *Buffer, size_t Length, int Flags)
+    {
+        // Find a server associated with this socket and send.
+        auto Server = Localnetworking::Findserver(size_t(Socket));
+        if (!Server) return CALLPOSIX(send, Socket, Buffer, Length, Flags);
+
+        if (!Buffer)
+        {
+            errno = EFAULT;
+            return -1;
+        }
+
+        // Datagram sockets need a connected address.
+        if (isDatagram(Socket))
+        {
+            Address_t Address{};
+            bool Connected = false;
+
+            Peerguard.lock();
+            {
+                auto Entry = Connectedpeers.find(Socket);
+                Connected = Entry != Connectedpeers.end();
+                if (Connected) Address = Entry->second;
+            }
+            Peerguard.unlock();
+
+            if (Connected) return Sendpacket(Server, Socket, Address, Buffer, Length, Flags);
+
+            errno = EDESTADDRREQ;
+            return -1;
+        }
+
+        // If we are on a blocking socket, poll until successful.
+        auto Size = uint32_t(std::min(Length, size_t(UINT32_MAX)));
+        bool Blocking = isBlocking(Socket, Flags);
+        do
+        {
+            if (Server->onStreamwrite(Socket, Buffer, Size)) return ssize_t(Size);
+            if (Blocking) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        } while (Blocking);
+
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t Sendto(int Socket, const void *Buffer, size_t Length, int Flags, const struct sockaddr *To, socklen_t Tolength)
+    {
+        // Connected sockets may omit the address.
+        if (!To) return Send(Socket, Buffer, Length, Flags);
+        if (!isInternet(To, Tolength)) return CALLPOSIX(sendto, Socket, Buffer, Length, Flags, To, Tolength);
+
+        // Find a server associated with this socket or address.
+        auto Server = Localnetworking::Findserver(Plainaddress(To));
+        if (!Server) Server = Localnetworking::Findserver(size_t(Socket));
+        if (!Server) return CALLPOSIX(sendto, Socket, Buffer, Length, Flags, To, Tolength);
+
+        if (!Buffer)
+        {
+            errno = EFAULT;
+            return -1;
+        }
+
+        // Associate the socket if we haven't.
+        auto Address = Localaddress(To);
+        Localnetworking::Createsocket(Server, Socket);
+        Localnetworking::Addfilter(Socket, Address);
+
+        return Sendpacket(Server, Socket, Address, Buffer, Length, Flags);
+    }
+    int Getaddrinfo(const char *Nodename, const char *Servicename, const struct addrinfo *Hints, struct addrinfo **Result)
+    {
+        // Create a server from the hostname, or ask libc for it.
+        auto Server = Nodename ? Localnetworking::Createserver(Nodename) : nullptr;
+        if (!Server) return CALLPOSIX(getaddrinfo, Nodename, Servicename, Hints, Result);
+
+        // Let libc allocate the result for a known host, our fake address is IPv4.
+        struct addrinfo Localhints{};
+        if (Hints) Localhints = *Hints;
+        Localhints.ai_family = AF_INET;
+        Localhints.ai_flags &= ~AI_CANONNAME;
+
+        int Status = CALLPOSIX(getaddrinfo, "localhost", Servicename, &Localhints, Result);
+        if (0 != Status) return Status;
+
+        // Associate the hostname and server with the fake IP address we created.
+        uint32_t IPHash = Hash::FNV1a_32(Nodename);
+        Localnetworking::Registerhost(Nodename, IPHash, Server);
+
+        // Set the IP for all records.
+        for (struct addrinfo *ptr = *Result; ptr != NULL; ptr = ptr->ai_next)
+        {
+            ((sockaddr_in *)ptr->ai_addr)->sin_addr.s_addr = IPHash;
+        }
+
+        // Notify the developer about this event.
+        Debugprint(va("%s: \"%s\" -> %s", __func__, Nodename, Plainaddress((*Result)->ai_addr).c_str()));
+        return 0;
+    }
+    int Close(int Socket)
+    {
+        // Every descriptor is closed through here, so files and foreign sockets only take shared locks.
+        if (Localnetworking::Hasfilters(size_t(Socket))) Localnetworking::Removefilters(Socket);
+
+        // Find a server associated with this socket and disconnect it.
+        auto Server = Localnetworking::Findserver(size_t(Socket));
+        if (!Server) return CALLPOSIX(close, Socket);
+
+        Server->onDisconnect(Socket);
+        Localnetworking::Destroysocket(Server, Socket);
+        Forgetsocket(Socket);
+
+        return CALLPOSIX(close, Socket);
+    }
+
+    // Installer.
+    void POSIXInstaller()
+    {
+        Enabled = true;
+    };
+
+    // Add the installer on startup.
+    struct Installer { Installer() { Localnetworking::Addplatform(POSIXInstaller); }; };
+    static Installer Startup{};
+}
+
+// The interposed libc exports.
+#define INTERPOSE(_Function, _Replacement, ...) \
+    POSIX::Initializepreloaded(); \
+    return POSIX::Enabled ? POSIX::_Replacement(__VA_ARGS__) : CALLPOSIX(_Function, __VA_ARGS__);
+extern "C"
+{
+    EXPORT_ATTR int socket(int Domain, int Type, int Protocol) noexcept
+    {
+        INTERPOSE(socket, Socket, Domain, Type, Protocol);
+    }
+    EXPORT_ATTR int bind(int Socket, const struct sockaddr *Name, socklen_t Namelength) noexcept
+    {
+        INTERPOSE(bind, Bind, Socket, Name, Namelength);
+    }
+    EXPORT_ATTR int connect(int Socket, const struct sockaddr *Name, socklen_t Namelength)
+    {
+        INTERPOSE(connect, Connect, Socket, Name, Namelength);
+    }
+    EXPORT_ATTR ssize_t recv(int Socket, void *Buffer, size_t Length, int Flags)
+    {
+        INTERPOSE(recv, Receive, Socket, Buffer, Length, Flags);
+    }
+    EXPORT_ATTR ssize_t recvfrom(int Socket, void *Buffer, size_t Length, int Flags, struct sockaddr *From, socklen_t *Fromlength)
+    {
+        INTERPOSE(recvfrom, Receivefrom, Socket, Buffer, Length, Flags, From, Fromlength);
+    }
+    EXPORT_ATTR ssize_t send(int Socket, const void *Buffer, size_t Length, int Flags)
+    {
+        INTERPOSE(send, Send, Socket, Buffer, Length, Flags);
+    }
+    EXPORT_ATTR ssize_t sendto(int Socket, const void *Buffer, size_t Length, int Flags, const struct sockaddr *To, socklen_t Tolength)
+    {
+        INTERPOSE(sendto, Sendto, Socket, Buffer, Length, Flags, To, Tolength);
+    }
+    EXPORT_ATTR int getaddrinfo(const char *Nodename, const char *Servicename, const struct addrinfo *Hints, struct addrinfo **Result)
+    {
+        INTERPOSE(getaddrinfo, Getaddrinfo, Nodename, Servicename, Hints, Result);
+    }
+    EXPORT_ATTR int close(int Socket)
+    {
+        INTERPOSE(close, Close, Socket);
+    }
+}
+
+#undef INTERPOSE
+#undef CALLPOSIX
+#endif
@@ -46,6 +46,24 @@ namespace Winsock
 
     #pragma region Helpers
     std::unordered_map<size_t /* Socket */, bool> Blockingsockets;
+    std::unordered_map<size_t /* Socket */, uint32_t> Receivetimeouts;
+    std::mutex Timeoutguard;
+
+    // Milliseconds a blocking read may still wait, 0 when it has timed out.
+    uint32_t Remainingtime(size_t Socket, std::chrono::steady_clock::time_point Start)
+    {
+        uint32_t Timeout = 0;
+        Timeoutguard.lock();
+        {
+            auto Entry = Receivetimeouts.find(Socket);
+            if (Entry != Receivetimeouts.end()) Timeout = Entry->second;
+        }
+        Timeoutguard.unlock();
+        if (0 == Timeout) return 1000;
+
+        auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start).count();
+        return Elapsed >= int64_t(Timeout) ? 0 : uint32_t(Timeout - Elapsed);
+    }
 
     std::string Plainaddress(const struct sockaddr *Sockaddr)
     {
@@ -146,6 +164,24 @@ namespace Winsock
         if (Result == -1) WSASetLastError(Lasterror);
         return Result;
     }
+    int __stdcall Setsocketoption(size_t Socket, int Level, int Optionname, const char *Optionvalue, int Optionlength)
+    {
+        int Result = 0;
+
+        // Track the receive-timeout for blocking reads on our sockets.
+        if (Level == SOL_SOCKET && Optionname == SO_RCVTIMEO && Optionvalue && Optionlength >= int(sizeof(DWORD)))
+        {
+            Timeoutguard.lock();
+            {
+                Receivetimeouts[Socket] = *(DWORD *)Optionvalue;
+            }
+            Timeoutguard.unlock();
+        }
+
+        CALLWS(setsockopt, &Result, Socket, Level, Optionname, Optionvalue, Optionlength);
+        if (Result == -1) WSASetLastError(Lasterror);
+        return Result;
+    }
     int __stdcall Receive(size_t Socket, char *Buffer, int Length, int Flags)
     {
         bool Successful = false;
@@ -178,15 +214,20 @@ namespace Winsock
                 }
             }
 
-            // If we are on a blocking socket, poll until successful.
+            // If we are on a blocking socket, wait until the server has data.
+            auto Start = std::chrono::steady_clock::now();
+            uint32_t Remaining = 1;
             do
             {
                 Successful = Server->onStreamread(Socket, Buffer, &Result);
-                if (!Successful) std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            } while (!Successful && Blockingsockets[Socket]);
+                if (Successful || !Blockingsockets[Socket]) break;
+
+                Remaining = Remainingtime(Socket, Start);
+                if (Remaining) Localnetworking::Waitforstream(Server, Socket, Remaining);
+            } while (Remaining);
 
             // Ensure that any errors are non-fatal.
-            if (!Successful) WSASetLastError(WSAEWOULDBLOCK);
+            if (!Successful) WSASetLastError(Remaining ? WSAEWOULDBLOCK : WSAETIMEDOUT);
         }
 
         // Ask Windows to fetch some data from the socket if it's not ours.
@@ -212,13 +253,18 @@ namespace Winsock
         // Check if it's a socket associated with our network.
         if (Localnetworking::isInternalsocket(Socket))
         {
-            Address_t Localfrom; std::string Packet;
+            Localnetworking::Frame_t Frame;
+            auto Start = std::chrono::steady_clock::now();
+            uint32_t Remaining = 1;
 
             // Check if there's any data on the socket and return that.
             do
             {
-                if (Localnetworking::Dequeueframe(Socket, Localfrom, Packet))
+                if (Localnetworking::Dequeueframes(Socket, &Frame, 1))
                 {
+                    auto &Localfrom = Frame.From;
+                    auto &Packet = *Frame.Data;
+
                     // Notify the developer that they'll have to deal with this.
                     if (Flags)
                     {
@@ -257,11 +303,14 @@ namespace Winsock
                     return std::min(uint32_t(std::min(size_t(Length), Packet.size())), uint32_t(INT32_MAX));
                 }
 
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            } while (Blockingsockets[Socket]);
+                // Wait for the next frame if we are on a blocking socket.
+                if (!Blockingsockets[Socket]) break;
+                Remaining = Remainingtime(Socket, Start);
+                if (Remaining) Localnetworking::Waitforframe(Socket, Remaining);
+            } while (Remaining);
 
             // Send an error if there's no data.
-            WSASetLastError(WSAEWOULDBLOCK);
+            WSASetLastError(Remaining ? WSAEWOULDBLOCK : WSAETIMEDOUT);
             return -1;
         }
 
@@ -277,7 +326,8 @@ namespace Winsock
         std::vector<size_t> Readsockets;
         std::vector<size_t> Writesockets;
 
-        for (auto &Item : Localnetworking::Internalsockets())
+        auto Internalsockets = Localnetworking::Internalsockets();
+        for (auto &Item : *Internalsockets)
         {
             if (Readfds)
             {
@@ -458,17 +508,14 @@ namespace Winsock
 
         // Create a fake IP address from the hostname.
         uint32_t IPHash = Hash::FNV1a_32(Hostname);
-        uint8_t *IP = (uint8_t *)&IPHash;
 
-        // Associate the server instance with the fake IP address we created.
-        auto ReadableIP = va("%u.%u.%u.%u", IP[0], IP[1], IP[2], IP[3]);
-        Localnetworking::Forceresolvehost(ReadableIP, Hostname);
-        Localnetworking::Duplicateserver(ReadableIP, Server);
+        // Associate the hostname and server with the fake IP address we created.
+        Localnetworking::Registerhost(Hostname, IPHash, Server);
 
         // Create the Winsock address struct.
         auto Localaddress = new in_addr();
         auto LocalsocketAddresslist = new in_addr*[2]();
-        Localaddress->S_un.S_addr = inet_addr(ReadableIP.c_str());
+        Localaddress->S_un.S_addr = IPHash;
         LocalsocketAddresslist[0] = Localaddress;
         LocalsocketAddresslist[1] = nullptr;
 
@@ -504,17 +551,14 @@ namespace Winsock
 
             // Create a fake IP address from the hostname.
             uint32_t IPHash = Hash::FNV1a_32(Nodename);
-            uint8_t *IP = (uint8_t *)&IPHash;
 
-            // Associate the server instance with the fake IP address we created.
-            auto ReadableIP = va("%u.%u.%u.%u", IP[0], IP[1], IP[2], IP[3]);
-            Localnetworking::Forceresolvehost(ReadableIP, Nodename);
-            Localnetworking::Duplicateserver(ReadableIP, Server);
+            // Associate the hostname and server with the fake IP address we created.
+            Localnetworking::Registerhost(Nodename, IPHash, Server);
 
             // Set the IP for all records.
             for (ADDRINFOA *ptr = *Result; ptr != NULL; ptr = ptr->ai_next)
             {
-                ((sockaddr_in *)ptr->ai_addr)->sin_addr.S_un.S_addr = inet_addr(ReadableIP.c_str());
+                ((sockaddr_in *)ptr->ai_addr)->sin_addr.S_un.S_addr = IPHash;
             }
         }
 
@@ -546,17 +590,14 @@ namespace Winsock
 
             // Create a fake IP address from the hostname.
             uint32_t IPHash = Hash::FNV1a_32(Hostname.c_str());
-            uint8_t *IP = (uint8_t *)&IPHash;
 
-            // Associate the server instance with the fake IP address we created.
-            auto ReadableIP = va("%u.%u.%u.%u", IP[0], IP[1], IP[2], IP[3]);
-            Localnetworking::Forceresolvehost(ReadableIP, Hostname);
-            Localnetworking::Duplicateserver(ReadableIP, Server);
+            // Associate the hostname and server with the fake IP address we created.
+            Localnetworking::Registerhost(Hostname, IPHash, Server);
 
             // Set the IP for all records.
             for (ADDRINFOW *ptr = *Result; ptr != NULL; ptr = ptr->ai_next)
             {
-                ((sockaddr_in *)ptr->ai_addr)->sin_addr.S_un.S_addr = inet_addr(ReadableIP.c_str());
+                ((sockaddr_in *)ptr->ai_addr)->sin_addr.S_un.S_addr = IPHash;
             }
         }
 
@@ -578,13 +619,9 @@ namespace Winsock
             sockaddr_in *Localname = reinterpret_cast<sockaddr_in *>(Name);
             *Namelength = sizeof(sockaddr_in);
 
-            auto Hostname = Localnetworking::Findhostname(Server);
-            auto Address = inet_addr(Hostname.c_str());
-            if (!Address) Address = Hash::FNV1a_32(Hostname.c_str());
-
             Localname->sin_port = 0;
             Localname->sin_family = AF_INET;
-            Localname->sin_addr.S_un.S_addr = Address;
+            Localname->sin_addr.S_un.S_addr = Localnetworking::Findaddress(Server);
         }
 
         if (!Server && Result == -1) WSASetLastError(Lasterror);
@@ -603,13 +640,9 @@ namespace Winsock
             sockaddr_in *Localname = reinterpret_cast<sockaddr_in *>(Name);
             *Namelength = sizeof(sockaddr_in);
 
-            auto Hostname = Localnetworking::Findhostname(Server);
-            auto Address = inet_addr(Hostname.c_str());
-            if (!Address) Address = Hash::FNV1a_32(Hostname.c_str());
-
             Localname->sin_port = 0;
             Localname->sin_family = AF_INET;
-            Localname->sin_addr.S_un.S_addr = Address;
+            Localname->sin_addr.S_un.S_addr = Localnetworking::Findaddress(Server);
         }
 
         if(!Server && Result == -1) WSASetLastError(Lasterror);
@@ -620,8 +653,17 @@ namespace Winsock
         // Find a server associated with this socket and disconnect it.
         auto Server = Localnetworking::Findserver(Socket);
         if (Server) Server->onDisconnect(Socket);
-        CALLWS_NORET(closesocket, Socket);
+        if (Server) Localnetworking::Destroysocket(Server, Socket);
+        Localnetworking::Removefilters(Socket);
 
+        // Forget the timeout before the handle can be reused.
+        Timeoutguard.lock();
+        {
+            Receivetimeouts.erase(Socket);
+        }
+        Timeoutguard.unlock();
+
+        CALLWS_NORET(closesocket, Socket);
         return 0;
     }
     int __stdcall Shutdown(size_t Socket, int How)
@@ -669,6 +711,7 @@ namespace Winsock
         INSTALL_HOOK("bind", Bind);
         INSTALL_HOOK("connect", Connect);
         INSTALL_HOOK("ioctlsocket", IOControlsocket);
+        INSTALL_HOOK("setsockopt", Setsocketoption);
         INSTALL_HOOK("recv", Receive);
         INSTALL_HOOK("recvfrom", Receivefrom);
         INSTALL_HOOK("select", Select);
@@ -13,6 +13,8 @@
 #include "Configuration/Macros.hpp"
 
 // Standard libraries.
+#include <condition_variable>
+#include <shared_mutex>
 #include <unordered_map>
 #include <string_view>
 #include <algorithm>
@@ -27,7 +29,10 @@
 #include <chrono>
 #include <thread>
 #include <string>
+#include <deque>
 #include <mutex>
+#include <regex>
+#include <queue>
 #include <ctime>
 
 // Platformspecific libraries.
@@ -40,6 +40,32 @@ inline bool Fileexists(std::string Path)
     std::fclose(Filehandle);
     return true;
 }
+inline size_t Filesize(std::string Path)
+{
+    std::FILE *Filehandle = std::fopen(Path.c_str(), "rb");
+    if (!Filehandle) return 0;
+
+    std::fseek(Filehandle, 0, SEEK_END);
+    auto Length = std::ftell(Filehandle);
+    std::fclose(Filehandle);
+
+    return Length < 0 ? 0 : size_t(Length);
+}
+#if defined(_WIN32)
+inline int64_t Filetime(std::string Path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA Fileinfo;
+    if (!GetFileAttributesExA(Path.c_str(), GetFileExInfoStandard, &Fileinfo)) return 0;
+    return (int64_t(Fileinfo.ftLastWriteTime.dwHighDateTime) << 32) | Fileinfo.ftLastWriteTime.dwLowDateTime;
+}
+#else
+inline int64_t Filetime(std::string Path)
+{
+    struct stat Fileinfo;
+    if (stat(Path.c_str(), &Fileinfo) == -1) return 0;
+    return int64_t(Fileinfo.st_mtime);
+}
+#endif
 
 // List all files in a directory.
 #if defined(_WIN32)
@@ -23,27 +23,35 @@ namespace Package
     std::string Read(std::string Filename)
     {
         auto Handle = Loadarchive("./Plugins/" MODULENAME "." MODULEEXTENSION);
-        return Read(Handle, Filename);
+        auto Result = Read(Handle, Filename);
+        Closearchive(Handle);
+        return Result;
     }
     void Write(std::string Filename, std::string &Buffer)
     {
         auto Handle = Loadarchive("./Plugins/" MODULENAME "." MODULEEXTENSION);
-        return Write(Handle, Filename, Buffer);
+        Write(Handle, Filename, Buffer);
+        Closearchive(Handle);
     }
     std::vector<std::string> Findfiles(std::string Criteria)
     {
         auto Handle = Loadarchive("./Plugins/" MODULENAME "." MODULEEXTENSION);
-        return Findfiles(Handle, Criteria);
+        auto Result = Findfiles(Handle, Criteria);
+        Closearchive(Handle);
+        return Result;
     }
     bool Exists(std::string Filename)
     {
         auto Handle = Loadarchive("./Plugins/" MODULENAME "." MODULEEXTENSION);
-        return Exists(Handle, Filename);
+        auto Result = Exists(Handle, Filename);
+        Closearchive(Handle);
+        return Result;
     }
     void Delete(std::string Filename)
     {
         auto Handle = Loadarchive("./Plugins/" MODULENAME "." MODULEEXTENSION);
-        return Delete(Handle, Filename);
+        Delete(Handle, Filename);
+        Closearchive(Handle);
     }
 
     // Operations on a specific archive.
@@ -58,6 +66,12 @@ namespace Package
 
         return new miniz_cpp::zip_file(Filename);
     }
+    void Closearchive(Archivehandle &Handle)
+    {
+        // The archive is kept in memory, so free it when done.
+        delete reinterpret_cast<miniz_cpp::zip_file *>(Handle);
+        Handle = nullptr;
+    }
     void Savearchive(Archivehandle &Handle, std::string Filename)
     {
         auto Archive = reinterpret_cast<miniz_cpp::zip_file *>(Handle);
@@ -96,6 +110,17 @@ namespace Package
         auto Archive = reinterpret_cast<miniz_cpp::zip_file *>(Handle);
         return Archive->has_file(Filename);
     }
+    bool Fileinfo(Archivehandle &Handle, std::string Filename, uint32_t *Checksum, size_t *Filesize)
+    {
+        if (!Exists(Handle, Filename)) return false;
+
+        // Read from the central directory, without inflating the file.
+        auto Archive = reinterpret_cast<miniz_cpp::zip_file *>(Handle);
+        auto Info = Archive->getinfo(Filename);
+        if (Checksum) *Checksum = Info.crc;
+        if (Filesize) *Filesize = Info.file_size;
+        return true;
+    }
     void Delete(Archivehandle &Handle, std::string Filename)
     {
         if (!Exists(Handle, Filename)) return;
@@ -115,5 +140,6 @@ namespace Package
         std::vector<uint8_t> Buffer;
         Newarchive->save(Buffer);
         Archive->load(Buffer);
+        delete Newarchive;
     }
 }
@@ -22,10 +22,12 @@ namespace Package
 
     // Operations on a specific archive.
     Archivehandle Loadarchive(std::string Filename);
+    void Closearchive(Archivehandle &Handle);
     void Savearchive(Archivehandle &Handle, std::string Filename);
     std::string Read(Archivehandle &Handle, std::string Filename);
     void Write(Archivehandle &Handle, std::string Filename, std::string &Buffer);
     std::vector<std::string> Findfiles(Archivehandle &Handle, std::string Criteria);
     bool Exists(Archivehandle &Handle, std::string Filename);
     void Delete(Archivehandle &Handle, std::string Filename);
+    bool Fileinfo(Archivehandle &Handle, std::string Filename, uint32_t *Checksum, size_t *Filesize);
 }